@@ -7,14 +7,22 @@
 #include <sstream>
 #include <iostream>
 #include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <time.h>
+#include "slock.h"
 
-lock_client::lock_client(std::string dst) {
+lock_client::lock_client(std::string dst) : rlsrpc(nullptr) {
+    assert(pthread_mutex_init(&watch_m, nullptr) == 0);
+    pthread_condattr_t ca;
+    assert(pthread_condattr_init(&ca) == 0);
+    assert(pthread_condattr_setclock(&ca, CLOCK_MONOTONIC) == 0);
+    assert(pthread_cond_init(&notified_c, &ca) == 0);
+    assert(pthread_condattr_destroy(&ca) == 0);
     sockaddr_in dstsock;
     make_sockaddr(dst.c_str(), &dstsock);
+    // the first call binds cl, a round trip sooner than bind()
     cl = new rpcc(dstsock);
-    if (cl->bind() < 0) {
-        printf("lock_client: call bind\n");
-    }
 }
 
 int lock_client::stat(lock_protocol::lockid_t lid) {
@@ -34,3 +42,54 @@ lock_protocol::status lock_client::release(lock_protocol::lockid_t lid) {
     return cl->call(lock_protocol::release, cl->id(), lid, r);
 }
 
+
+// assumes thread holds watch_m
+void lock_client::start_callback_server() {
+    int rlock_port = ((random() % 32000) | (0x1 << 10));
+    std::ostringstream host;
+    host << "127.0.0.1:" << rlock_port;
+    id = host.str();
+    rlsrpc = new rpcs(rlock_port);
+    rlsrpc->reg(rlock_protocol::notify, this, &lock_client::notify_handler);
+}
+
+lock_protocol::status lock_client::watch(lock_protocol::lockid_t lid) {
+    unsigned int seen;
+    {
+        ScopedLock wl(&watch_m);
+        if (!rlsrpc)
+            start_callback_server();
+        // remember the count before subscribing so that a notify racing
+        // with the subscribe reply is not missed
+        seen = notified[lid];
+    }
+
+    while (true) {
+        int armed;
+        int ret = cl->call(lock_protocol::subscribe, cl->id(), lid, id, armed);
+        if (ret != lock_protocol::OK || !armed)
+            return ret;
+
+        ScopedLock wl(&watch_m);
+        struct timespec now, deadline;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        add_timespec(now, WATCH_RECHECK_MS, &deadline);
+        while (notified[lid] == seen) {
+            int r = pthread_cond_timedwait(&notified_c, &watch_m, &deadline);
+            if (r == ETIMEDOUT)
+                break;
+            assert(r == 0);
+        }
+        if (notified[lid] != seen)
+            return lock_protocol::OK;
+        // the notify may have been lost: subscribing again tells
+        // whether lid is still held
+    }
+}
+
+lock_protocol::status lock_client::notify_handler(lock_protocol::lockid_t lid, int &) {
+    ScopedLock wl(&watch_m);
+    notified[lid]++;
+    assert(pthread_cond_broadcast(&notified_c) == 0);
+    return lock_protocol::OK;
+}
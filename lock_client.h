@@ -7,11 +7,27 @@
 #include "lock_protocol.h"
 #include "rpc.h"
 #include <vector>
+#include <map>
+#include <pthread.h>
 
 // Client interface to the lock server
 class lock_client {
 protected:
     rpcc *cl;
+
+    // server for the lock server's callback RPCs, created on first use
+    rpcs *rlsrpc;
+    std::string id;
+
+    static const int WATCH_RECHECK_MS = 2000;
+
+    pthread_mutex_t watch_m;
+    pthread_cond_t notified_c;
+    // number of release notifications received per lock
+    std::map<lock_protocol::lockid_t, unsigned int> notified;
+
+    void start_callback_server();
+
 public:
     lock_client(std::string d);
 
@@ -22,6 +38,14 @@ public:
     virtual lock_protocol::status release(lock_protocol::lockid_t);
 
     virtual lock_protocol::status stat(lock_protocol::lockid_t);
+
+    // blocks until the server reports the next release of lid; returns
+    // at once if lid is not held.  if no report comes within
+    // WATCH_RECHECK_MS, subscribes again in case it was lost, and
+    // returns if lid is no longer held
+    virtual lock_protocol::status watch(lock_protocol::lockid_t);
+
+    virtual lock_protocol::status notify_handler(lock_protocol::lockid_t, int &);
 };
 
 
@@ -0,0 +1,117 @@
+// RPC stubs for clients that cache locks granted by lock_server
+
+#include "lock_client_cache.h"
+#include "rpc.h"
+#include "slock.h"
+#include "method_thread.h"
+#include <stdio.h>
+
+lock_client_cache::lock_client_cache(std::string dst) : lock_client(dst) {
+    assert(pthread_mutex_init(&m, nullptr) == 0);
+    assert(pthread_cond_init(&changed_c, nullptr) == 0);
+    {
+        ScopedLock wl(&watch_m);
+        if (!rlsrpc)
+            start_callback_server();
+    }
+    rlsrpc->reg(rlock_protocol::revoke, this, &lock_client_cache::revoke_handler);
+    assert(method_thread(this, true, &lock_client_cache::releaser) != 0);
+}
+
+lock_protocol::status lock_client_cache::acquire(lock_protocol::lockid_t lid) {
+    {
+        ScopedLock ml(&m);
+        while (true) {
+            cached_lock &lock = locks[lid];
+            if (lock.state == cached_lock::FREE) {
+                lock.state = cached_lock::LOCKED;
+                return lock_protocol::OK;
+            }
+            if (lock.state == cached_lock::NONE)
+                break;
+            assert(pthread_cond_wait(&changed_c, &m) == 0);
+        }
+        locks[lid].state = cached_lock::ACQUIRING;
+        locks[lid].revoked = false;
+        nacquire++;
+    }
+
+    int mode;
+    int ret = cl->call(lock_protocol::acquire_cacheable, cl->id(), lid, id, mode);
+
+    ScopedLock ml(&m);
+    cached_lock &lock = locks[lid];
+    if (ret != lock_protocol::OK) {
+        lock.state = cached_lock::NONE;
+        assert(pthread_cond_broadcast(&changed_c) == 0);
+        return ret;
+    }
+    // a revoke may already have overtaken the grant; it stays recorded
+    lock.state = cached_lock::LOCKED;
+    lock.cacheable = mode == lock_protocol::CACHED;
+    return lock_protocol::OK;
+}
+
+lock_protocol::status lock_client_cache::release(lock_protocol::lockid_t lid) {
+    {
+        ScopedLock ml(&m);
+        cached_lock &lock = locks[lid];
+        if (lock.state != cached_lock::LOCKED)
+            return lock_protocol::RPCERR;
+
+        if (lock.cacheable && !lock.revoked) {
+            lock.state = cached_lock::FREE;
+            assert(pthread_cond_broadcast(&changed_c) == 0);
+            return lock_protocol::OK;
+        }
+        lock.state = cached_lock::RELEASING;
+    }
+    return return_lock(lid);
+}
+
+// sends lid back to the server; called without m held on a lock in
+// state RELEASING
+lock_protocol::status lock_client_cache::return_lock(lock_protocol::lockid_t lid) {
+    int r;
+    lock_protocol::status ret = cl->call(lock_protocol::release, cl->id(), lid, r);
+
+    ScopedLock ml(&m);
+    cached_lock &lock = locks[lid];
+    lock.state = cached_lock::NONE;
+    lock.revoked = false;
+    assert(pthread_cond_broadcast(&changed_c) == 0);
+    return ret;
+}
+
+// must not block: the server's notifier thread waits for the reply
+lock_protocol::status lock_client_cache::revoke_handler(lock_protocol::lockid_t lid, int &) {
+    ScopedLock ml(&m);
+    cached_lock &lock = locks[lid];
+    if (lock.state == cached_lock::NONE || lock.state == cached_lock::RELEASING)
+        return lock_protocol::OK;
+
+    lock.revoked = true;
+    if (lock.state == cached_lock::FREE) {
+        lock.state = cached_lock::RELEASING;
+        releaseq.enq(lid);
+    }
+    return lock_protocol::OK;
+}
+
+int lock_client_cache::grant_mode(lock_protocol::lockid_t lid) {
+    ScopedLock ml(&m);
+    return locks[lid].cacheable ? lock_protocol::CACHED : lock_protocol::ARBITRATED;
+}
+
+unsigned int lock_client_cache::acquire_rpcs() {
+    ScopedLock ml(&m);
+    return nacquire;
+}
+
+void lock_client_cache::releaser() {
+    while (true) {
+        lock_protocol::lockid_t lid;
+        releaseq.deq(&lid);
+        return_lock(lid);
+    }
+}
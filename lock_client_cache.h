@@ -0,0 +1,63 @@
+// lock client interface that caches locks between uses.
+
+#ifndef lock_client_cache_h
+#define lock_client_cache_h
+
+#include <string>
+#include "lock_protocol.h"
+#include "lock_client.h"
+#include "rpc.h"
+#include "fifo.h"
+#include <map>
+#include <pthread.h>
+
+// Keeps locks granted in lock_protocol::CACHED mode after release so that
+// later acquires by this client need no RPC, until the server revokes them.
+// Locks granted in ARBITRATED mode are returned on every release.
+class lock_client_cache : public lock_client {
+private:
+    struct cached_lock {
+        enum {
+            NONE,       // this client does not hold the lock
+            FREE,       // held and cached, but no thread is using it
+            LOCKED,     // held and used by a thread of this client
+            ACQUIRING,  // waiting for the server to grant it
+            RELEASING   // being returned to the server
+        };
+        int state = NONE;
+        bool cacheable = false;
+        bool revoked = false;
+    };
+
+    pthread_mutex_t m;
+    pthread_cond_t changed_c;
+    std::map<lock_protocol::lockid_t, cached_lock> locks;
+
+    // locks revoked while cached and free, returned by the releaser thread
+    fifo<lock_protocol::lockid_t> releaseq;
+
+    unsigned int nacquire = 0;  // acquire RPCs sent, protected by m
+
+    lock_protocol::status return_lock(lock_protocol::lockid_t);
+
+public:
+    lock_client_cache(std::string d);
+
+    virtual ~lock_client_cache() {};
+
+    virtual lock_protocol::status acquire(lock_protocol::lockid_t);
+
+    virtual lock_protocol::status release(lock_protocol::lockid_t);
+
+    virtual lock_protocol::status revoke_handler(lock_protocol::lockid_t, int &);
+
+    // how the server granted lid the last time, and how many acquire
+    // RPCs this client has sent: what the server's caching policy costs
+    int grant_mode(lock_protocol::lockid_t);
+
+    unsigned int acquire_rpcs();
+
+    void releaser();
+};
+
+#endif
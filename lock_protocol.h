@@ -15,8 +15,23 @@ public:
     enum rpc_numbers {
         acquire = 0x7001,
         release,
-        subscribe,    // for lab 5
-        stat
+        subscribe,    // watch a lock for its next release
+        stat,
+        acquire_cacheable   // acquire by a client that can cache the lock
+    };
+    // how a client may use a lock it was granted
+    enum grant_mode {
+        ARBITRATED,   // return the lock to the server on every release
+        CACHED        // keep the lock until the server revokes it
+    };
+};
+
+// RPCs the lock server makes back to its clients
+class rlock_protocol {
+public:
+    enum rpc_numbers {
+        notify = 0x8001,
+        revoke
     };
 };
 
@@ -6,6 +6,13 @@
 #include <unistd.h>
 #include <arpa/inet.h>
 #include "slock.h"
+#include "method_thread.h"
+
+lock_server::lock_server() {
+    nacquire = 0;
+    assert(pthread_mutex_init(&server_lock, nullptr) == 0);
+    assert(method_thread(this, true, &lock_server::notifier) != 0);
+}
 
 lock_protocol::status lock_server::stat(int clt, lock_protocol::lockid_t lid, int &r) {
     lock_protocol::status ret = lock_protocol::OK;
@@ -14,7 +21,40 @@ lock_protocol::status lock_server::stat(int clt, lock_protocol::lockid_t lid, in
     return ret;
 }
 
-lock_protocol::status lock_server::acquire(int clt, lock_protocol::lockid_t lid, int &) {
+lock_protocol::status lock_server::acquire(int clt, lock_protocol::lockid_t lid, int &r) {
+    return this->grant(clt, lid, "", r);
+}
+
+lock_protocol::status lock_server::acquire_cacheable(int clt, lock_protocol::lockid_t lid, std::string id, int &r) {
+    return this->grant(clt, lid, id, r);
+}
+
+// assumes thread holds server_lock
+void lock_server::update_policy(Lock &lock, int clt, bool waited) {
+    // a grant is contended if the lock was busy or changes hands; with
+    // caching every such grant costs an extra revoke and release
+    bool contended = waited || (lock.last_client != -1 && lock.last_client != clt);
+    lock.contention += ((contended ? CONTENTION_ONE : 0) - lock.contention) / 8;
+    lock.last_client = clt;
+
+    if (lock.policy == lock_protocol::CACHED && lock.contention > ARBITRATE_ABOVE)
+        lock.policy = lock_protocol::ARBITRATED;
+    else if (lock.policy == lock_protocol::ARBITRATED && lock.contention < CACHE_BELOW)
+        lock.policy = lock_protocol::CACHED;
+}
+
+// assumes thread holds server_lock
+void lock_server::revoke_if_wanted(Lock &lock) {
+    if (lock.status == Lock::LOCKED && lock.cached && !lock.revoke_sent && lock.waiting > 0) {
+        this->notifyq.enq(notification{lock.holder_id, lock.id, rlock_protocol::revoke,
+                                       lock.grants});
+        lock.revoke_sent = true;
+    }
+}
+
+// grants lid to clt; a non-empty id is the callback address of a
+// client that is able to cache the lock, and r returns the grant mode
+lock_protocol::status lock_server::grant(int clt, lock_protocol::lockid_t lid, const std::string &id, int &r) {
     ScopedLock scoped_sl(&this->server_lock);
 
     // create and add lock lid to locks map if it does not exist
@@ -22,12 +62,26 @@ lock_protocol::status lock_server::acquire(int clt, lock_protocol::lockid_t lid,
         this->locks.emplace(lid, Lock(lid, clt));
     Lock &lock = this->locks.at(lid);
 
-    // wait until lock is free
-    while (lock.status == Lock::LOCKED)
+    // wait until lock is free, asking a caching holder to give it back
+    bool waited = lock.status == Lock::LOCKED;
+    lock.waiting++;
+    while (lock.status == Lock::LOCKED) {
+        this->revoke_if_wanted(lock);
         assert(pthread_cond_wait(&lock.is_free_c_, &this->server_lock) == 0);
+    }
+    lock.waiting--;
+
+    this->update_policy(lock, clt, waited);
 
     lock.status = Lock::LOCKED;
     lock.client_id = clt;
+    lock.cached = !id.empty() && lock.policy == lock_protocol::CACHED;
+    lock.revoke_sent = false;
+    lock.grants++;
+    lock.holder_id = id;
+    r = lock.cached ? lock_protocol::CACHED : lock_protocol::ARBITRATED;
+
+    this->revoke_if_wanted(lock);
 
     return lock_protocol::OK;
 }
@@ -44,11 +98,103 @@ lock_protocol::status lock_server::release(int clt, lock_protocol::lockid_t lid,
 
         lock.status = Lock::FREE;
         lock.client_id = -1;
+        lock.cached = false;
         assert(pthread_cond_signal(&lock.is_free_c_) == 0);
 
+        // every watch fires once, on the first release after it was armed
+        for (const std::string &id : lock.watchers)
+            this->notifyq.enq(notification{id, lid, rlock_protocol::notify});
+        lock.watchers.clear();
+
         return lock_protocol::OK;
     }
 
     // lock does not exist
     return lock_protocol::RPCERR;
 }
+
+// r is set to 1 if the watch was armed and a notify RPC will follow,
+// and to 0 if the lock is not held (the caller need not wait)
+lock_protocol::status lock_server::subscribe(int clt, lock_protocol::lockid_t lid, std::string id, int &r) {
+    ScopedLock scoped_sl(&this->server_lock);
+
+    auto it = this->locks.find(lid);
+    if (it == this->locks.end() || it->second.status == Lock::FREE) {
+        r = 0;
+        return lock_protocol::OK;
+    }
+
+    it->second.watchers.insert(id);
+    r = 1;
+    return lock_protocol::OK;
+}
+
+rpcc *lock_server::get_client(const std::string &id) {
+    auto it = this->callback_clients.find(id);
+    if (it != this->callback_clients.end())
+        return it->second;
+
+    sockaddr_in dstsock;
+    make_sockaddr(id.c_str(), &dstsock);
+    rpcc *cl = new rpcc(dstsock);
+    if (cl->bind(rpcc::to(1000)) < 0) {
+        printf("lock_server: cannot bind to client %s\n", id.c_str());
+        delete cl;
+        return nullptr;
+    }
+    this->callback_clients[id] = cl;
+    return cl;
+}
+
+// whether a notification is worth sending again.  a notify is, until
+// it has been tried NOTIFY_ATTEMPTS times.  a revoke is, while the
+// holding it ends still has waiters; if it has none left, the next
+// waiter's grant() sends a fresh one
+bool lock_server::still_wanted(const notification &n) {
+    if (n.proc == rlock_protocol::notify)
+        return n.attempts < NOTIFY_ATTEMPTS;
+
+    ScopedLock scoped_sl(&this->server_lock);
+    auto it = this->locks.find(n.lid);
+    if (it == this->locks.end())
+        return false;
+    Lock &lock = it->second;
+    if (lock.status != Lock::LOCKED || lock.grants != n.grant)
+        return false;
+    if (lock.waiting == 0) {
+        lock.revoke_sent = false;
+        return false;
+    }
+    return true;
+}
+
+void lock_server::retry_later(notification n) {
+    int ms = RETRY_MAX_MS;
+    if (n.attempts < 16 && (RETRY_MIN_MS << n.attempts) < ms)
+        ms = RETRY_MIN_MS << n.attempts;
+    n.attempts++;
+    TimerMgr::Instance()->schedule(ms, [this, n]() { this->notifyq.enq(n); });
+}
+
+void lock_server::notifier() {
+    while (true) {
+        notification n;
+        this->notifyq.deq(&n);
+        // the holder may have released the lock during the backoff
+        if (n.attempts > 0 && !this->still_wanted(n))
+            continue;
+
+        rpcc *cl = this->get_client(n.id);
+        int r;
+        if (cl != nullptr && cl->call(n.proc, n.lid, r, rpcc::to(1000)) == lock_protocol::OK)
+            continue;
+
+        if (cl != nullptr) {
+            // the client is gone; forget it so that a restarted client rebinds
+            this->callback_clients.erase(n.id);
+            delete cl;
+        }
+        if (this->still_wanted(n))
+            this->retry_later(n);
+    }
+}
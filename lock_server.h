@@ -8,8 +8,11 @@
 #include "lock_protocol.h"
 #include "lock_client.h"
 #include "rpc.h"
+#include "fifo.h"
 #include <pthread.h>
 #include <unordered_map>
+#include <map>
+#include <set>
 #include <cassert>
 
 class lock_server {
@@ -25,6 +28,21 @@ protected:
         lock_protocol::lockid_t id;
         int client_id;
         pthread_cond_t is_free_c_;
+        // callback addresses of clients waiting for the next release
+        std::set<std::string> watchers;
+
+        // the holder may keep the lock after using it until it is revoked
+        bool cached = false;
+        bool revoke_sent = false;
+        unsigned int grants = 0;  // tells the holdings of the lock apart
+        std::string holder_id;
+        int waiting = 0;
+
+        // caching policy, chosen from an exponentially weighted average of
+        // how often a grant had to wait or moved the lock to another client
+        int policy = lock_protocol::CACHED;
+        int last_client = -1;
+        int contention = 0;
 
         Lock(lock_protocol::lockid_t id, int client_id) {
             this->id = id;
@@ -41,12 +59,50 @@ protected:
 
     std::unordered_map<lock_protocol::lockid_t, Lock> locks;
 
-public:
-    lock_server() {
-        nacquire = 0;
-        assert(pthread_mutex_init(&server_lock, nullptr) == 0);
+    // contention is kept in 1/CONTENTION_ONE units; the two thresholds
+    // apart give the policy hysteresis so that it does not flap
+    static const int CONTENTION_ONE = 256;
+    static const int ARBITRATE_ABOVE = 160;
+    static const int CACHE_BELOW = 64;
+
+    void update_policy(Lock &lock, int clt, bool waited);
+
+    void revoke_if_wanted(Lock &lock);
+
+    lock_protocol::status grant(int clt, lock_protocol::lockid_t lid, const std::string &id, int &);
+
+    struct notification {
+        std::string id;
+        lock_protocol::lockid_t lid;
+        unsigned int proc;
+        unsigned int grant = 0;   // revokes: the holding to end
+        int attempts = 0;
     };
 
+    // a notification that could not be delivered is sent again after a
+    // backoff, for as long as it is still wanted.  a watcher stops
+    // waiting for a notify after a while (see lock_client::watch), so
+    // notifies are given up after NOTIFY_ATTEMPTS
+    static const int RETRY_MIN_MS = 100;
+    static const int RETRY_MAX_MS = 5000;
+    static const int NOTIFY_ATTEMPTS = 8;
+
+    bool still_wanted(const notification &n);
+
+    void retry_later(notification n);
+
+    // notify and revoke RPCs are sent by a dedicated thread so that
+    // a slow or dead client never stalls an RPC handler
+    fifo<notification> notifyq;
+
+    // connections to clients' callback servers, only used by the notifier thread
+    std::map<std::string, rpcc *> callback_clients;
+
+    rpcc *get_client(const std::string &id);
+
+public:
+    lock_server();
+
     ~lock_server() {
         assert(pthread_mutex_destroy(&server_lock) == 0);
     };
@@ -55,7 +111,13 @@ public:
 
     lock_protocol::status acquire(int clt, lock_protocol::lockid_t lid, int &);
 
+    lock_protocol::status acquire_cacheable(int clt, lock_protocol::lockid_t lid, std::string id, int &);
+
     lock_protocol::status release(int clt, lock_protocol::lockid_t lid, int &);
+
+    lock_protocol::status subscribe(int clt, lock_protocol::lockid_t lid, std::string id, int &);
+
+    void notifier();
 };
 
 #endif 
@@ -2,6 +2,7 @@
 #include <arpa/inet.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <sys/resource.h>
 #include "lock_server.h"
 #include "jsl_log.h"
 
@@ -20,12 +21,21 @@ int main(int argc, char *argv[]) {
 
     //jsl_set_debug(2);
 
+    // every client holds a connection (and so an fd) to the server
+    struct rlimit rl;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
 #ifndef RSM
     lock_server ls;
     rpcs server(atoi(argv[1]));
     server.reg(lock_protocol::stat, &ls, &lock_server::stat);
     server.reg(lock_protocol::acquire, &ls, &lock_server::acquire);
     server.reg(lock_protocol::release, &ls, &lock_server::release);
+    server.reg(lock_protocol::acquire_cacheable, &ls, &lock_server::acquire_cacheable);
+    server.reg(lock_protocol::subscribe, &ls, &lock_server::subscribe);
 #endif
 
     while (1)
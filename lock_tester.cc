@@ -4,12 +4,14 @@
 
 #include "lock_protocol.h"
 #include "lock_client.h"
+#include "lock_client_cache.h"
 #include "rpc.h"
 #include "jsl_log.h"
 #include <arpa/inet.h>
 #include <vector>
 #include <stdlib.h>
 #include <stdio.h>
+#include <atomic>
 
 // must be >= 2
 int nt = 10; //XXX: lab1's rpc handlers are blocking. Since rpcs uses a thread pool of 10 threads, we cannot test more than 10 blocking rpc.
@@ -18,6 +20,8 @@ lock_client **lc = new lock_client *[nt];
 lock_protocol::lockid_t a = 1;
 lock_protocol::lockid_t b = 2;
 lock_protocol::lockid_t c = 3;
+lock_protocol::lockid_t d = 4;
+lock_protocol::lockid_t e = 5;
 
 // check_grant() and check_release() check that the lock server
 // doesn't grant the same lock to both clients.
@@ -129,6 +133,79 @@ void *test5(void *x) {
     return 0;
 }
 
+lock_client_cache **lcc = new lock_client_cache *[nt];
+
+void *test7(void *x) {
+    int i = *(int *) x;
+
+    printf("test7: caching client %d acquire a release a concurrent\n", i);
+    for (int j = 0; j < 10; j++) {
+        lcc[i]->acquire(a);
+        check_grant(a);
+        check_release(a);
+        lcc[i]->release(a);
+    }
+    return 0;
+}
+
+// a caching client that loses the first revokes sent to it, as if the
+// server's RPCs had failed
+class lossy_client_cache : public lock_client_cache {
+public:
+    std::atomic<int> drops;
+
+    lossy_client_cache(std::string d, int n) : lock_client_cache(d), drops(n) {}
+
+    lock_protocol::status revoke_handler(lock_protocol::lockid_t lid, int &r) {
+        if (drops > 0) {
+            drops--;
+            return lock_protocol::RPCERR;
+        }
+        return lock_client_cache::revoke_handler(lid, r);
+    }
+};
+
+// a client that loses the first release notifications sent to it
+class lossy_client : public lock_client {
+public:
+    std::atomic<int> drops;
+
+    lossy_client(std::string d, int n) : lock_client(d), drops(n) {}
+
+    lock_protocol::status notify_handler(lock_protocol::lockid_t lid, int &r) {
+        if (drops > 0) {
+            drops--;
+            return lock_protocol::RPCERR;
+        }
+        return lock_client::notify_handler(lid, r);
+    }
+};
+
+lossy_client *lossy_watcher;
+
+void *test9(void *x) {
+    lossy_watcher->watch(e);
+    return 0;
+}
+
+int watched;
+
+void *test6(void *x) {
+    int i = *(int *) x;
+
+    printf("test6: client %d watch a\n", i);
+    lc[i]->watch(a);
+    pthread_mutex_lock(&count_mutex);
+    watched = 1;
+    if (ct[a & 0xff] != 0) {
+        fprintf(stderr, "error: watch on %016llx returned while it is held\n", a);
+        exit(1);
+    }
+    pthread_mutex_unlock(&count_mutex);
+    printf("test6: client %d saw a released\n", i);
+    return 0;
+}
+
 int main(int argc, char *argv[]) {
     int r;
     pthread_t th[nt];
@@ -149,8 +226,8 @@ int main(int argc, char *argv[]) {
 
     if (argc > 2) {
         test = atoi(argv[2]);
-        if (test < 1 || test > 5) {
-            printf("Test number must be between 1 and 5\n");
+        if (test < 1 || test > 9) {
+            printf("Test number must be between 1 and 9\n");
             exit(1);
         }
     }
@@ -219,6 +296,128 @@ int main(int argc, char *argv[]) {
         }
     }
 
+    if (!test || test == 6) {
+        printf("test 6\n");
+
+        // test 6
+        lc[0]->acquire(a);
+        check_grant(a);
+        int *w = new int(1);
+        r = pthread_create(&th[0], NULL, test6, (void *) w);
+        assert (r == 0);
+        sleep(1);
+        pthread_mutex_lock(&count_mutex);
+        if (watched) {
+            fprintf(stderr, "error: watch on %016llx returned before release\n", a);
+            exit(1);
+        }
+        pthread_mutex_unlock(&count_mutex);
+        check_release(a);
+        lc[0]->release(a);
+        pthread_join(th[0], NULL);
+        if (lc[1]->watch(a) != lock_protocol::OK) {
+            fprintf(stderr, "error: watch on free lock %016llx failed\n", a);
+            exit(1);
+        }
+    }
+
+    if (!test || test == 7) {
+        printf("test 7\n");
+
+        // test 7: a private lock stays cached, a shared one is revoked
+        // and then arbitrated, and goes back to being cached only once
+        // it has been private for a while
+        for (int i = 0; i < nt; i++) lcc[i] = new lock_client_cache(dst);
+        unsigned int rpcs = lcc[0]->acquire_rpcs();
+        for (int j = 0; j < 100; j++) {
+            lcc[0]->acquire(c);
+            check_grant(c);
+            check_release(c);
+            lcc[0]->release(c);
+        }
+        if (lcc[0]->acquire_rpcs() != rpcs + 1 ||
+            lcc[0]->grant_mode(c) != lock_protocol::CACHED) {
+            fprintf(stderr, "error: private lock %016llx was not cached\n", c);
+            exit(1);
+        }
+        for (int i = 0; i < nt; i++) {
+            int *a = new int(i);
+            r = pthread_create(&th[i], NULL, test7, (void *) a);
+            assert (r == 0);
+        }
+        for (int i = 0; i < nt; i++) {
+            pthread_join(th[i], NULL);
+        }
+        // every grant of a went to a client other than the last one, so
+        // the server has switched it to arbitrated grants.  the policy
+        // switches back below a lower threshold than it switched at,
+        // which takes more than a few private grants
+        int arbitrated = 0;
+        for (int j = 0; j < 30; j++) {
+            lcc[0]->acquire(a);
+            check_grant(a);
+            check_release(a);
+            int mode = lcc[0]->grant_mode(a);
+            lcc[0]->release(a);
+            if (mode == lock_protocol::CACHED)
+                break;
+            arbitrated++;
+        }
+        if (arbitrated < 5 || arbitrated == 30) {
+            fprintf(stderr, "error: lock %016llx arbitrated for %d grants\n",
+                    a, arbitrated);
+            exit(1);
+        }
+        printf("test7: shared lock arbitrated for %d private grants\n",
+               arbitrated);
+        lc[0]->acquire(c);
+        check_grant(c);
+        check_release(c);
+        lc[0]->release(c);
+    }
+
+    if (!test || test == 8) {
+        printf("test 8\n");
+
+        // test 8: the first revoke to the holder is lost, and the server
+        // sends it again rather than leave the waiter blocked
+        lossy_client_cache *lossy = new lossy_client_cache(dst, 1);
+        lossy->acquire(d);
+        check_grant(d);
+        check_release(d);
+        lossy->release(d);
+        lc[0]->acquire(d);
+        check_grant(d);
+        if (lossy->drops != 0) {
+            fprintf(stderr, "error: revoke of %016llx was never lost\n", d);
+            exit(1);
+        }
+        check_release(d);
+        lc[0]->release(d);
+        printf("test8: lost revoke sent again\n");
+    }
+
+    if (!test || test == 9) {
+        printf("test 9\n");
+
+        // test 9: the first notify to a watcher is lost, and the server
+        // sends it again
+        lossy_watcher = new lossy_client(dst, 1);
+        lc[0]->acquire(e);
+        check_grant(e);
+        r = pthread_create(&th[0], NULL, test9, NULL);
+        assert (r == 0);
+        sleep(1);
+        check_release(e);
+        lc[0]->release(e);
+        pthread_join(th[0], NULL);
+        if (lossy_watcher->drops != 0) {
+            fprintf(stderr, "error: notify of %016llx was never lost\n", e);
+            exit(1);
+        }
+        printf("test9: lost notify sent again\n");
+    }
+
     printf("%s: passed all tests successfully\n", argv[0]);
 
 }
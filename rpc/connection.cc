@@ -4,18 +4,34 @@
 #include <errno.h>
 #include <signal.h>
 #include <unistd.h>
+#include <sys/uio.h>
+#include <poll.h>
+#include <string.h>
+#include <vector>
+#include <atomic>
 
 #include "method_thread.h"
 #include "connection.h"
 #include "slock.h"
 #include "pollmgr.h"
+#include "timermgr.h"
 #include "jsl_log.h"
 
 #define MAX_PDU (10<<20) //maximum PDF is 10M
+#define MAX_WRITEV 64 //maximum number of queued pdus per writev
+#define RBUF_SZ (64<<10) //size of a connection's receive buffer
+#define RBUF_BIG (16<<10) //pdus larger than this get a buffer of their own
+#define RETRY_MS 1 //delay before handing up a refused pdu again
+#define BORROW_WAIT_MS 1000 //longest send waits for borrowed bytes to go out
 
 
+static std::atomic<unsigned long long> next_serial(1);
+
 connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+: mgr_(m1), fd_(f1), serial_(next_serial++), poll_(PollMgr::Assign()),
+  dead_(false), nqueued_(0),
+  nwritten_(0), wwaiters_(0), rbuf_(NULL), rhead_(0), rtail_(0),
+  retry_pending_(false), refno_(1),lossy_(l1)
 {
 
 	int flags = fcntl(fd_, F_GETFL, NULL);
@@ -25,10 +41,13 @@ connection::connection(chanmgr *m1, int f1, int l1)
 	signal(SIGPIPE, SIG_IGN);
 	assert(pthread_mutex_init(&m_,0)==0);
 	assert(pthread_mutex_init(&ref_m_,0)==0);
-	assert(pthread_cond_init(&send_wait_,0)==0);
-	assert(pthread_cond_init(&send_complete_,0)==0);
+	pthread_condattr_t ca;
+	assert(pthread_condattr_init(&ca)==0);
+	assert(pthread_condattr_setclock(&ca, CLOCK_MONOTONIC)==0);
+	assert(pthread_cond_init(&written_c_,&ca)==0);
+	assert(pthread_condattr_destroy(&ca)==0);
 
-	PollMgr::Instance()->add_callback(fd_, CB_RDONLY, this);
+	poll_->add_callback(fd_, CB_RDONLY, this);
 }
 
 connection::~connection()
@@ -36,11 +55,12 @@ connection::~connection()
 	assert(dead_);
 	assert(pthread_mutex_destroy(&m_)== 0);
 	assert(pthread_mutex_destroy(&ref_m_)== 0);
-	assert(pthread_cond_destroy(&send_wait_) == 0);
-	assert(pthread_cond_destroy(&send_complete_) == 0);
-	if (rpdu_.buf)
-		free(rpdu_.buf);
-	assert(!wpdu_.buf);
+	assert(pthread_cond_destroy(&written_c_)== 0);
+	if (rbuf_)
+		rbuf_->decref();
+	if (rbig_.buf)
+		rbig_.buf->decref();
+	drop_wq();
 	close(fd_);
 }
 
@@ -66,13 +86,15 @@ connection::closeconn()
 		if (!dead_) {
 			dead_ = true;
 			shutdown(fd_,SHUT_RDWR);
+			if (wwaiters_)
+				assert(pthread_cond_broadcast(&written_c_) == 0);
 		}else{
 			return;
 		}
 	}
 	//after block_remove_fd, select will never wait on fd_ 
 	//and no callbacks will be active
-	PollMgr::Instance()->block_remove_fd(fd_);
+	poll_->block_remove_fd(fd_);
 }
 
 void
@@ -102,20 +124,21 @@ connection::ref()
 }
 
 bool
-connection::send(char *b, int sz)
+connection::send(rpcbuf *b, int sz)
 {
 	ScopedLock ml(&m_);
-	waiters_++;
-	while (!dead_ && wpdu_.buf) {
-		assert(pthread_cond_wait(&send_wait_, &m_)==0);
-	}
-	waiters_--;
 	if (dead_) {
 		return false;
 	}
-	wpdu_.buf = b;
-	wpdu_.sz = sz;
-	wpdu_.solong = 0;
+
+	//fill in the pdu size for the receiver; every send of the same
+	//buffer writes the same value
+	sz += b->seg_bytes();
+	int nsz = htonl(sz);
+	bcopy(&nsz, b->data(), sizeof(nsz));
+	b->incref();
+	wq_.push_back(charbuf(b, sz));
+	unsigned long long seq = nqueued_++;
 
 	if (lossy_) {
 		if ((random()%100) < lossy_) {
@@ -124,27 +147,51 @@ connection::send(char *b, int sz)
 		}
 	}
 
-	if (!writepdu()) {
-		dead_ = true;
-		assert(pthread_mutex_unlock(&m_) == 0);
-		PollMgr::Instance()->block_remove_fd(fd_);
-		assert(pthread_mutex_lock(&m_) == 0);
-	}else{
-		if (wpdu_.solong == wpdu_.sz) {
-		}else{
-			//should be rare to need to explicitly add write callback
-			PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
-			while (!dead_ && wpdu_.solong >= 0 && wpdu_.solong < wpdu_.sz) {
-				assert(pthread_cond_wait(&send_complete_,&m_) == 0);
-			}
+	//unless the poll thread is already draining the queue
+	if (wq_.size() == 1) {
+		if (!writepdus()) {
+			//not block_remove_fd(): a completion may send from the
+			//poll thread, which would then wait on itself
+			poll_->del_callback(fd_, CB_RDWR);
+			die();
+			return false;
+		}
+		if (!wq_.empty()) {
+			//let the poll thread write the rest
+			poll_->add_callback(fd_, CB_WRONLY, this);
+		}
+	}
+
+	if (b->borrows())
+		wait_written(seq, b);
+	return true;
+}
+
+//waits until the seq'th pdu queued, b, has been written or dropped.  a
+//peer that reads too slowly does not hold the sender for long: past
+//BORROW_WAIT_MS the rest of the borrowed bytes are copied instead.
+//assumes thread holds m_
+void
+connection::wait_written(unsigned long long seq, rpcbuf *b)
+{
+	struct timespec deadline;
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += BORROW_WAIT_MS / 1000;
+	deadline.tv_nsec += (BORROW_WAIT_MS % 1000) * 1000000;
+	if (deadline.tv_nsec >= 1000000000) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000;
+	}
+
+	wwaiters_++;
+	while (nwritten_ <= seq && !dead_) {
+		if (pthread_cond_timedwait(&written_c_, &m_, &deadline) == ETIMEDOUT) {
+			if (nwritten_ <= seq && !dead_)
+				b->own_borrowed();
+			break;
 		}
 	}
-	bool ret = (!dead_ && wpdu_.solong == wpdu_.sz);
-	wpdu_.solong = wpdu_.sz = 0;
-	wpdu_.buf = NULL;
-	if (waiters_ > 0)
-		pthread_cond_broadcast(&send_wait_);
-	return ret;
+	wwaiters_--;
 }
 
 //fd_ is ready to be written
@@ -152,128 +199,309 @@ void
 connection::write_cb(int s)
 {
 	ScopedLock ml(&m_);
-	assert(!dead_);
 	assert(fd_ == s);
-	if (wpdu_.sz == 0) {
-		PollMgr::Instance()->del_callback(fd_,CB_WRONLY);
+	//a send on another thread may have found the connection dead
+	//after the poll thread looked this callback up
+	if (dead_)
 		return;
+	if (!writepdus()) {
+		poll_->del_callback(fd_, CB_RDWR);
+		die();
+	} else if (wq_.empty()) {
+		poll_->del_callback(fd_,CB_WRONLY);
+	}
+}
+
+//work got_pdu deferred until m_ is released
+static thread_local std::vector<std::function<void()> > deferred;
+
+void
+connection::defer(std::function<void()> f)
+{
+	deferred.push_back(std::move(f));
+}
+
+void
+connection::run_deferred()
+{
+	//f may hand up pdus of its own, and defer more
+	while (!deferred.empty()) {
+		std::vector<std::function<void()> > fs;
+		fs.swap(deferred);
+		for (unsigned int i = 0; i < fs.size(); i++)
+			fs[i]();
 	}
-	if (!writepdu()) {
-		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
-		dead_ = true;
-	}else{
-		assert(wpdu_.solong >= 0);
-		if (wpdu_.solong < wpdu_.sz) {
-			return;
-		}
-	} 
-	pthread_cond_signal(&send_complete_);
 }
 
 //fd_ is ready to be read
 void
 connection::read_cb(int s)
 {
-	ScopedLock ml(&m_);
-	assert(fd_ == s);
-	if (dead_)  {
-		return;
+	{
+		ScopedLock ml(&m_);
+		assert(fd_ == s);
+		if (!dead_)
+			readpdus();
 	}
+	run_deferred();
+}
 
-	bool succ = true;
-	if (!rpdu_.buf || rpdu_.solong < rpdu_.sz) {
-		succ = readpdu();
+//TimerMgr callback retrying pdus the chanmgr refused before
+void
+connection::retry_cb()
+{
+	{
+		ScopedLock ml(&m_);
+		retry_pending_ = false;
+		if (!dead_)
+			readpdus();
 	}
+	run_deferred();
+	decref();
+}
 
-	if (!succ) {
-		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
-		dead_ = true;
-		pthread_cond_signal(&send_complete_);
+//reads until the socket is drained, handing up every complete pdu.
+//assumes thread holds m_
+void
+connection::readpdus()
+{
+	//stop early if the chanmgr cannot take a pdu, and retry shortly:
+	//the data may all be buffered already, so the socket need not
+	//become readable again
+	bool more = true;
+	int ret;
+	while ((ret = deliverpdus()) > 0 && more) {
+		if (readbytes(&more) < 0) {
+			ret = -1;
+			break;
+		}
 	}
 
-	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
-		if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
-			//chanmgr has successfully consumed the pdu
-			rpdu_.buf = NULL;
-			rpdu_.sz = rpdu_.solong = 0;
-		}
+	if (ret < 0) {
+		poll_->del_callback(fd_,CB_RDWR);
+		die();
+	} else if (ret == 0 && !retry_pending_) {
+		retry_pending_ = true;
+		incref();
+		TimerMgr::Instance()->schedule(RETRY_MS, [this]() { retry_cb(); });
+	}
+
+	//idle connections do not keep a receive buffer
+	if (rbuf_ && rhead_ == rtail_) {
+		rbuf_->decref();
+		rbuf_ = NULL;
+		rhead_ = rtail_ = 0;
 	}
 }
 
-bool
-connection::writepdu()
+//the peer went away or the socket failed: drops what is left to send
+//and lets the chanmgr know, so it need not wait for a timeout to notice.
+//assumes thread holds m_
+void
+connection::die()
+{
+	dead_ = true;
+	drop_wq();
+	mgr_->dead_conn(this);
+}
+
+// assumes thread holds m_
+void
+connection::drop_wq()
 {
-	assert(wpdu_.solong >= 0);
-	if (wpdu_.solong == wpdu_.sz)
-		return true;
+	for (unsigned int i = 0; i < wq_.size(); i++)
+		wq_[i].buf->decref();
+	nwritten_ += wq_.size();
+	wq_.clear();
+	if (wwaiters_)
+		assert(pthread_cond_broadcast(&written_c_) == 0);
+}
 
-	if (wpdu_.solong == 0) {
-		int sz = htonl(wpdu_.sz);
-		bcopy(&sz,wpdu_.buf,sizeof(sz));
+//fills iov with the unwritten bytes of queued pdu c, its own bytes with
+//its segments spliced in; returns the number of entries used, at most
+//max
+static int
+pdu_iov(const connection::charbuf &c, struct iovec *iov, int max)
+{
+	rpcbuf *b = c.buf;
+	const std::vector<rpcseg> *segs = b->segs();
+	if (!segs) {
+		iov[0].iov_base = b->data() + c.solong;
+		iov[0].iov_len = c.sz - c.solong;
+		return 1;
 	}
-	int n = write(fd_, wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
-	if (n < 0) {
-		if (errno != EAGAIN) {
-			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
-			wpdu_.solong = -1;
-			wpdu_.sz = 0;
+
+	int n = 0;
+	int skip = c.solong;
+	auto add = [&](const char *p, int len) {
+		if (skip >= len) {
+			skip -= len;
+		} else if (n < max) {
+			iov[n].iov_base = (void *)(p + skip);
+			iov[n].iov_len = len - skip;
+			skip = 0;
+			n++;
 		}
-		return (errno == EAGAIN);
+	};
+
+	int isz = c.sz - b->seg_bytes();
+	int off = 0;
+	for (unsigned int i = 0; i < segs->size(); i++) {
+		const rpcseg &g = (*segs)[i];
+		add(b->data() + off, g.off - off);
+		add(g.p, g.len);
+		off = g.off;
 	}
-	wpdu_.solong += n;
-	return true;
+	add(b->data() + off, isz - off);
+	return n;
 }
 
+//writes queued pdus, MAX_WRITEV at a time, until the queue is empty or
+//the socket is full; the poll thread only reports the socket writable
+//again after it filled up.  returns false if the connection failed
 bool
-connection::readpdu()
+connection::writepdus()
 {
-	if (!rpdu_.sz) {
-		int sz, sz1;
-		int n = read(fd_, &sz1, sizeof(sz1));
-
-		if (n == 0) {
-			return false;
+	struct iovec iov[MAX_WRITEV];
+	while (!wq_.empty()) {
+		int n = 0;
+		ssize_t total = 0;
+		for (unsigned int i = 0; i < wq_.size() && n < MAX_WRITEV; i++) {
+			int k = pdu_iov(wq_[i], iov + n, MAX_WRITEV - n);
+			for (int j = n; j < n + k; j++)
+				total += iov[j].iov_len;
+			n += k;
 		}
 
-		if (n < 0) {
-			assert(errno!=EAGAIN);
-			return false;
+		ssize_t w = writev(fd_, iov, n);
+		if (w < 0) {
+			if (errno != EAGAIN) {
+				jsl_log(JSL_DBG_1, "connection::writepdus fd_ %d failure errno=%d\n", fd_, errno);
+			}
+			return (errno == EAGAIN);
 		}
 
-		if (n >0 && n!= sizeof(sz)) {
-			jsl_log(JSL_DBG_OFF, "connection::readpdu short read of sz\n");
-			return false;
+		ssize_t left = w;
+		while (left > 0) {
+			charbuf &head = wq_.front();
+			int l = head.sz - head.solong;
+			if (left < l) {
+				head.solong += left;
+				break;
+			}
+			left -= l;
+			head.buf->decref();
+			wq_.pop_front();
+			nwritten_++;
+			if (wwaiters_)
+				assert(pthread_cond_broadcast(&written_c_) == 0);
 		}
+		if (w < total)
+			break;
+	}
+	return true;
+}
+
+//reads once into the free space of the receive buffer.  returns the
+//number of bytes read or -1 on failure; *more is set if the read filled
+//the space, so the socket may hold more
+int
+connection::readbytes(bool *more)
+{
+	char *p;
+	int space;
+	if (rbig_.buf) {
+		p = rbig_.buf->data() + rbig_.solong;
+		space = rbig_.sz - rbig_.solong;
+	} else {
+		if (!rbuf_)
+			rbuf_ = rpcbuf::alloc(RBUF_SZ);
+		p = rbuf_->data() + rtail_;
+		space = RBUF_SZ - rtail_;
+	}
+
+	int n = read(fd_, p, space);
+	if (n == 0) {
+		return -1;
+	}
+	if (n < 0) {
+		*more = false;
+		return (errno == EAGAIN) ? 0 : -1;
+	}
+
+	*more = (n == space);
+	if (rbig_.buf)
+		rbig_.solong += n;
+	else
+		rtail_ += n;
+	return n;
+}
+
+//hands every complete pdu in the receive buffers to the chanmgr.
+//returns 1 if all were taken, 0 if the chanmgr refused one and -1 if
+//the stream is corrupt
+int
+connection::deliverpdus()
+{
+	if (rbig_.buf) {
+		if (rbig_.solong < rbig_.sz)
+			return 1;
+		if (!mgr_->got_pdu(this, rbig_.buf, rbig_.buf->data(), rbig_.sz))
+			return 0;
+		rbig_ = charbuf();
+	}
+	if (!rbuf_)
+		return 1;
 
+	char *b = rbuf_->data();
+	while (rtail_ - rhead_ >= (int)sizeof(int)) {
+		int sz1, sz;
+		bcopy(b + rhead_, &sz1, sizeof(sz1));
 		sz = ntohl(sz1);
+		if (sz > MAX_PDU || sz < (int)sizeof(sz)) {
+			jsl_log(JSL_DBG_2, "connection::deliverpdus bad pdu size %d\n", sz);
+			return -1;
+		}
 
-		if (sz > MAX_PDU) {
-			char *tmpb = (char *)&sz1;
-			jsl_log(JSL_DBG_2, "connection::readpdu read pdu TOO BIG %d network order=%x %x %x %x %x\n", sz, 
-					sz1, tmpb[0],tmpb[1],tmpb[2],tmpb[3]);
-			return false;
+		int avail = rtail_ - rhead_;
+		if (avail >= sz) {
+			rbuf_->incref();
+			if (!mgr_->got_pdu(this, rbuf_, b + rhead_, sz)) {
+				rbuf_->decref();
+				return 0;
+			}
+			rhead_ += sz;
+		} else if (sz > RBUF_BIG) {
+			//read the rest of a big pdu straight into its own buffer
+			rbig_.buf = rpcbuf::alloc(sz);
+			rbig_.sz = sz;
+			rbig_.solong = avail;
+			bcopy(b + rhead_, rbig_.buf->data(), avail);
+			rhead_ = rtail_;
+			break;
+		} else {
+			break;
 		}
+	}
 
-		rpdu_.sz = sz;
-		assert(rpdu_.buf == NULL);
-		rpdu_.buf = (char *)malloc(sz+sizeof(sz));
-		assert(rpdu_.buf);
-		bcopy(&sz1,rpdu_.buf,sizeof(sz));
-		rpdu_.solong = sizeof(sz);
-	}
-
-	int n = read(fd_, rpdu_.buf + rpdu_.solong, rpdu_.sz - rpdu_.solong);
-	if (n <= 0) {
-		if (errno == EAGAIN)
-			return true;
-		if (rpdu_.buf)
-			free(rpdu_.buf);
-		rpdu_.buf = NULL;
-		rpdu_.sz = rpdu_.solong = 0;
-		return (errno == EAGAIN);
-	}
-	rpdu_.solong += n;
-	return true;
+	//make room for the next read.  slices handed up keep the buffer
+	//alive, so only an unshared buffer can be reused in place
+	int left = rtail_ - rhead_;
+	if (rhead_ == rtail_ && !rbuf_->shared()) {
+		rhead_ = rtail_ = 0;
+	} else if (RBUF_SZ - rtail_ < RBUF_BIG) {
+		if (rbuf_->shared()) {
+			rpcbuf *nb = rpcbuf::alloc(RBUF_SZ);
+			bcopy(b + rhead_, nb->data(), left);
+			rbuf_->decref();
+			rbuf_ = nb;
+		} else {
+			memmove(b, b + rhead_, left);
+		}
+		rhead_ = 0;
+		rtail_ = left;
+	}
+	return 1;
 }
 
 tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest) 
@@ -366,32 +594,32 @@ tcpsconn::process_accept()
 void
 tcpsconn::accept_conn()
 {
-	fd_set rfds;
-	int max_fd = pipe_[0] > tcp_ ? pipe_[0] : tcp_;
+	//poll rather than select: a busy server's fds outgrow FD_SETSIZE
+	struct pollfd fds[2];
+	fds[0].fd = pipe_[0];
+	fds[0].events = POLLIN;
+	fds[1].fd = tcp_;
+	fds[1].events = POLLIN;
 
 	while (1) { 
-		FD_ZERO(&rfds);
-		FD_SET(pipe_[0], &rfds);
-		FD_SET(tcp_, &rfds);
-
-		int ret = select(max_fd+1, &rfds, NULL, NULL, NULL);
+		int ret = poll(fds, 2, -1);
 
 		if (ret < 0) {
 			if (errno == EINTR) {
 				continue;
 			} else {
-				perror("accept_conn select:");
+				perror("accept_conn poll:");
 				jsl_log(JSL_DBG_OFF, "tcpsconn::accept_conn failure errno %d\n",errno);
 				assert(0);
 	                }
 		}
 
-		if (FD_ISSET(pipe_[0], &rfds)) {
+		if (fds[0].revents) {
 			close(pipe_[0]);
 			close(tcp_);
 			return;
 		}
-		else if (FD_ISSET(tcp_, &rfds)) {
+		else if (fds[1].revents & POLLIN) {
 			process_accept();
 		} else {
 			assert(0);
@@ -399,21 +627,115 @@ tcpsconn::accept_conn()
 	}
 }
 
-connection *
-connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy)
+// one connect in progress.  the socket turning writable (or failing)
+// and the timeout race to claim it; the winner finishes it on the
+// TimerMgr thread, after which nothing else refers to it
+class connector : public aio_callback {
+	public:
+		connector(int fd, chanmgr *mgr, int lossy,
+				std::function<void(connection *)> done)
+			: fd_(fd), mgr_(mgr), lossy_(lossy), done_(done),
+			poll_(PollMgr::Assign()), watched_(false), timer_(0),
+			err_(0), claimed_(false) {
+			assert(pthread_mutex_init(&m_, NULL) == 0);
+		}
+		~connector() { assert(pthread_mutex_destroy(&m_) == 0); }
+
+		void start(const sockaddr_in &dst, int timeout_ms);
+		void read_cb(int s) { ready(); }
+		void write_cb(int s) { ready(); }
+
+	private:
+		bool claim();
+		void ready();
+		void finish(bool reported);
+
+		const int fd_;
+		chanmgr *mgr_;
+		const int lossy_;
+		std::function<void(connection *)> done_;
+		PollMgr *poll_;
+		bool watched_;
+		TimerMgr::timer_id timer_;
+		int err_;
+		std::atomic<bool> claimed_;
+		pthread_mutex_t m_; // held by start, so finish waits for it
+};
+
+bool
+connector::claim()
 {
-	int s= socket(AF_INET, SOCK_STREAM, 0);
-	int yes = 1;
-	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
-	if(connect(s, (sockaddr*)&dst, sizeof(dst)) < 0) {
-		jsl_log(JSL_DBG_1, "rpcc::connect_to_dst failed to %s:%d\n", 
-				inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
-		close(s);
-		return NULL;
+	bool f = false;
+	return claimed_.compare_exchange_strong(f, true);
+}
+
+void
+connector::start(const sockaddr_in &dst, int timeout_ms)
+{
+	if (connect(fd_, (sockaddr *)&dst, sizeof(dst)) < 0 &&
+			errno != EINPROGRESS) {
+		err_ = errno;
+		claim();
+		TimerMgr::Instance()->schedule(0, [this]() { finish(false); });
+		return;
 	}
-	jsl_log(JSL_DBG_2, "connect_to_dst fd=%d to dst %s:%d\n",
-			s, inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
-	return new connection(mgr, s, lossy);
+	//even a connect that is already done reports through the poll
+	//loop, so that done never runs on the caller's thread
+	ScopedLock ml(&m_);
+	timer_ = TimerMgr::Instance()->schedule(timeout_ms, [this]() {
+		if (claim())
+			finish(false);
+	});
+	watched_ = true;
+	poll_->add_callback(fd_, CB_WRONLY, this);
 }
 
+//the connect completed or failed.  called by the poll thread, perhaps
+//twice for the same event, so it only hands over to the TimerMgr
+void
+connector::ready()
+{
+	if (claim())
+		TimerMgr::Instance()->schedule(0, [this]() { finish(true); });
+}
 
+void
+connector::finish(bool reported)
+{
+	{
+		ScopedLock ml(&m_);
+	}
+	//on the TimerMgr thread, so the timeout is not running
+	if (timer_)
+		TimerMgr::Instance()->cancel(timer_, false);
+	if (watched_)
+		poll_->block_remove_fd(fd_);
+
+	connection *c = NULL;
+	socklen_t len = sizeof(err_);
+	if (reported && getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err_, &len) < 0)
+		err_ = errno;
+	if (reported && !err_) {
+		jsl_log(JSL_DBG_2, "connect_async fd=%d connected\n", fd_);
+		c = new connection(mgr_, fd_, lossy_);
+	} else {
+		jsl_log(JSL_DBG_1, "connect_async fd=%d failed: %s\n", fd_,
+				err_ ? strerror(err_) : "timed out");
+		close(fd_);
+	}
+	done_(c);
+	delete this;
+}
+
+void
+connect_async(const sockaddr_in &dst, chanmgr *mgr, int lossy,
+		int timeout_ms, std::function<void(connection *)> done)
+{
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	int yes = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	fcntl(s, F_SETFL, fcntl(s, F_GETFL, NULL) | O_NONBLOCK);
+	jsl_log(JSL_DBG_2, "connect_async fd=%d to dst %s:%d\n",
+			s, inet_ntoa(dst.sin_addr), (int)ntohs(dst.sin_port));
+	(new connector(s, mgr, lossy, done))->start(dst, timeout_ms);
+}
@@ -7,14 +7,22 @@
 #include <netinet/in.h>
 
 #include <map>
+#include <deque>
+#include <functional>
 
 #include "pollmgr.h"
+#include "rpcbuf.h"
 
 class connection;
 
 class chanmgr {
 	public:
-		virtual bool got_pdu(connection *c, char *b, int sz) = 0;
+		// hands up the sz byte PDU at pdu, which lies inside b.  on
+		// success the chanmgr takes over a reference to b
+		virtual bool got_pdu(connection *c, rpcbuf *b, char *pdu, int sz) = 0;
+		// c has just failed on its own (not through closeconn).  called
+		// with c's lock held, so it must neither block nor use c
+		virtual void dead_conn(connection *c) {}
 		virtual ~chanmgr() {}
 };
 
@@ -22,8 +30,8 @@ class connection : public aio_callback {
 	public:
 		struct charbuf {
 			charbuf(): buf(NULL), sz(0), solong(0) {}
-			charbuf (char *b, int s) : buf(b), sz(s), solong(0){}
-			char *buf;
+			charbuf (rpcbuf *b, int s) : buf(b), sz(s), solong(0){}
+			rpcbuf *buf;
 			int sz;
 			int solong; //amount of bytes written or read so far
 		};
@@ -32,10 +40,16 @@ class connection : public aio_callback {
 		~connection();
 
 		int channo() { return fd_; }
+		// unlike channo(), never reused by a later connection
+		unsigned long long serial() { return serial_; }
 		bool isdead();
 		void closeconn();
 
-		bool send(char *b, int sz);
+		// queues the PDU made of the first sz bytes of b and b's segments
+		// and returns without waiting for it to be written; the
+		// connection keeps its own reference to b.  if b borrows
+		// segments, send returns once they have been written
+		bool send(rpcbuf *b, int sz);
 		void write_cb(int s);
 		void read_cb(int s);
 
@@ -43,26 +57,55 @@ class connection : public aio_callback {
 		void decref();
 		int ref();
 
+		// for got_pdu: runs f on this thread once the connection handing
+		// up the pdu has released its lock, so that f may send, even on
+		// the same connection
+		static void defer(std::function<void()> f);
+
 	private:
+		static void run_deferred();
 
-		bool readpdu();
-		bool writepdu();
+		void readpdus();
+		void retry_cb();
+		int readbytes(bool *more);
+		int deliverpdus();
+		bool writepdus();
+		void drop_wq();
+		void die();
+		void wait_written(unsigned long long seq, rpcbuf *b);
 
 		chanmgr *mgr_;
 		const int fd_;
+		const unsigned long long serial_;
+		PollMgr *const poll_; //the reactor watching fd_
 		bool dead_;
 
-		charbuf wpdu_;
-		charbuf rpdu_;
+		// PDUs waiting to be written, oldest first; the poll thread
+		// of poll_ drains it with writev whenever fd_ is writable
+		std::deque<charbuf> wq_;
+		// PDUs ever queued and ever written (or dropped); senders of
+		// borrowed segments wait on written_c_ for theirs to go out
+		unsigned long long nqueued_;
+		unsigned long long nwritten_;
+		int wwaiters_;
+		pthread_cond_t written_c_;
+
+		// received bytes not yet handed up lie in rbuf_ between rhead_
+		// and rtail_.  small PDUs are handed up as slices of rbuf_, so
+		// one read can deliver many; a big PDU gets its own buffer rbig_.
+		// a slice keeps all of rbuf_ alive, so a chanmgr that holds on
+		// to PDUs copies the small ones out (see rpcs::got_pdu)
+		rpcbuf *rbuf_;
+		int rhead_;
+		int rtail_;
+		charbuf rbig_;
+		bool retry_pending_;
 
-		int waiters_;
 		int refno_;
 		const int lossy_;
 
 		pthread_mutex_t m_;
 		pthread_mutex_t ref_m_;
-		pthread_cond_t send_complete_;
-		pthread_cond_t send_wait_;
 };
 
 class tcpsconn {
@@ -93,5 +136,11 @@ struct bundle {
 };
 
 void start_accept_thread(chanmgr *mgr, int port, pthread_t *th, int *fd = NULL, int lossy=0);
-connection *connect_to_dst(const sockaddr_in &dst, chanmgr *mgr, int lossy=0);
+
+// connects to dst without blocking the caller: the connect completes in
+// the poll loop.  done runs on the TimerMgr thread, never the caller's,
+// with the new connection, or NULL if the connect failed or took longer
+// than timeout_ms.  done must not block
+void connect_async(const sockaddr_in &dst, chanmgr *mgr, int lossy,
+		int timeout_ms, std::function<void(connection *)> done);
 #endif
@@ -6,10 +6,18 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <algorithm>
+#include <utility>
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <type_traits>
+
+#include "rpcbuf.h"
 
 struct req_header {
 	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
@@ -22,16 +30,47 @@ struct req_header {
 };
 
 struct reply_header {
-	reply_header(int x=0, int r=0): xid(x), ret(r) {}
+	reply_header(int x=0, int r=0, int s=0): xid(x), ret(r), srv_nonce(s) {}
 	int xid;
 	int ret;
+	unsigned int srv_nonce; // the server instance that replied
 };
 
+// network order is big-endian.  rpc_hton/rpc_ntoh convert unsigned
+// integers of each width; rpc_uint<N>::type is the one N bytes wide
+static inline uint8_t rpc_hton(uint8_t x) { return x; }
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+static inline uint16_t rpc_hton(uint16_t x) { return __builtin_bswap16(x); }
+static inline uint32_t rpc_hton(uint32_t x) { return __builtin_bswap32(x); }
+static inline uint64_t rpc_hton(uint64_t x) { return __builtin_bswap64(x); }
+#else
+static inline uint16_t rpc_hton(uint16_t x) { return x; }
+static inline uint32_t rpc_hton(uint32_t x) { return x; }
+static inline uint64_t rpc_hton(uint64_t x) { return x; }
+#endif
+template <class U> static inline U rpc_ntoh(U x) { return rpc_hton(x); }
+
+template <int N> struct rpc_uint {};
+template <> struct rpc_uint<1> { typedef uint8_t type; };
+template <> struct rpc_uint<2> { typedef uint16_t type; };
+template <> struct rpc_uint<4> { typedef uint32_t type; };
+template <> struct rpc_uint<8> { typedef uint64_t type; };
+
+// integral types other than bool travel as sizeof(T) bytes in network
+// order, so arrays of them can be converted in bulk
+template <class T> struct rpc_fixed : std::integral_constant<bool,
+	std::is_integral<T>::value && !std::is_same<T, bool>::value> {};
+
 typedef uint64_t rpc_checksum_t;
 typedef int rpc_sz_t;
 
-//size of initial buffer allocation 
-const int DEFAULT_RPC_SZ = 1024;
+//PDUs up to this size are built inside the marshall itself and only
+//copied into a right-sized rpcbuf when they are sent or kept
+const int RPC_INLINE_SZ = 256;
+
+//byte strings at least this long are attached to a PDU as segments
+//rather than copied into its buffer
+const int RPC_SEG_MIN = 8192;
 
 #if RPC_CHECKSUMMING
 	//size of rpc_header includes a 4-byte int to be filled by tcpchan and uint64_t checksum
@@ -40,38 +79,162 @@ const int DEFAULT_RPC_SZ = 1024;
 	const int RPC_HEADER_SZ = std::max(sizeof(req_header), sizeof(reply_header)) + sizeof(rpc_sz_t);
 #endif
 
+// rpcstr is a read-only view of bytes inside a received PDU.  It goes
+// over the wire exactly like std::string, so a handler can declare an
+// rpcstr argument where the client passes a std::string and get the
+// bytes without any copy.  It holds a reference to the PDU's buffer, so
+// it stays valid for as long as the view (or a copy of it) lives.  On the
+// server that buffer holds just the request, not a whole receive buffer.
+class rpcstr {
+	public:
+		rpcstr() : _rb(NULL), _p(NULL), _n(0) {}
+		rpcstr(rpcbuf *b, const char *p, unsigned int n) : _rb(b), _p(p), _n(n) {
+			if (_rb) _rb->incref();
+		}
+		rpcstr(const rpcstr &o) : _rb(o._rb), _p(o._p), _n(o._n) {
+			if (_rb) _rb->incref();
+		}
+		rpcstr(rpcstr &&o) : _rb(o._rb), _p(o._p), _n(o._n) {
+			o._rb = NULL;
+			o._p = NULL;
+			o._n = 0;
+		}
+		rpcstr &operator=(rpcstr o) {
+			std::swap(_rb, o._rb);
+			std::swap(_p, o._p);
+			std::swap(_n, o._n);
+			return *this;
+		}
+		~rpcstr() { if (_rb) _rb->decref(); }
+
+		const char *data() const { return _p; }
+		unsigned int size() const { return _n; }
+		bool empty() const { return _n == 0; }
+		const char *begin() const { return _p; }
+		const char *end() const { return _p + _n; }
+		char operator[](unsigned int i) const { return _p[i]; }
+		// the buffer the view points into
+		rpcbuf *buf() const { return _rb; }
+		// a copy of the bytes
+		std::string str() const { return std::string(_p, _n); }
+
+		bool operator==(const std::string &s) const {
+			return s.size() == _n && memcmp(s.data(), _p, _n) == 0;
+		}
+		bool operator!=(const std::string &s) const { return !(*this == s); }
+
+	private:
+		rpcbuf *_rb;
+		const char *_p;
+		unsigned int _n;
+};
+
 class marshall {
 	private:
-		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
+		rpcbuf *_rb;    // Buffer holding the raw bytes (dynamically readjusted)
+		char *_buf;     // Base of the raw bytes, _inl or _rb->data()
 		int _capa;      // Capacity of the buffer
 		int _ind;       // Read/write head position
+		bool _borrow;   // may refer to the caller's strings
+		alignas(8) char _inl[RPC_INLINE_SZ]; // the buffer until _rb exists
+
+		void make_room(int n);
+		// moves the bytes from _inl into an rpcbuf with room for n more
+		void spill(int n);
 
 	public:
 		marshall() {
-			_buf = (char *) malloc(sizeof(char)*DEFAULT_RPC_SZ);
-			assert(_buf);
-			_capa = DEFAULT_RPC_SZ;
+			_rb = NULL;
+			_buf = _inl;
+			_capa = RPC_INLINE_SZ;
 			_ind = RPC_HEADER_SZ;
+			_borrow = false;
 		}
 
+		// _buf may point into the object itself
+		marshall(const marshall &) = delete;
+		marshall &operator=(const marshall &) = delete;
+
 		~marshall() { 
-			if (_buf) 
-				free(_buf); 
+			if (_rb) 
+				_rb->decref(); 
 		}
 
 		int size() { return _ind;}
 		char *cstr() { return _buf;}
+		// the buffer itself, e.g. to send it; still owned by marshall.
+		// the PDU must be complete, as later bytes may go elsewhere
+		rpcbuf *buf() {
+			if (!_rb)
+				spill(0);
+			return _rb;
+		}
 
 		void rawbyte(unsigned char);
 		void rawbytes(const char *, int);
 
-		// Return the current contents (including header) as a string
+		// large strings marshalled by const reference are referred to
+		// rather than copied, so they must outlive every send of this
+		// PDU.  only for PDUs sent synchronously (rpcc::call)
+		void set_borrow(bool b) { _borrow = b; }
+		bool borrowing() { return _borrow; }
+
+		// splices n bytes at p into the PDU at the write head without
+		// copying them; they stay alive through a reference to rb, by
+		// being owned (s, which p points into) or, with neither, are
+		// borrowed
+		void rawseg(const char *p, int n, rpcbuf *rb, std::string *s) {
+			if (!_rb)
+				spill(_capa);
+			rpcseg g = { _ind, p, n, rb, s };
+			_rb->add_seg(g);
+		}
+
+		// room for n more bytes at the write head, which it returns
+		char *reserve(int n) {
+			if (_ind + n > _capa)
+				make_room(n);
+			return _buf + _ind;
+		}
+
+		// fixed-width values are bounds-checked once and stored whole
+		template <class T> void put(T x) {
+			typedef typename rpc_uint<sizeof(T)>::type U;
+			U y = rpc_hton((U) x);
+			memcpy(reserve(sizeof(y)), &y, sizeof(y));
+			_ind += sizeof(y);
+		}
+
+		// n fixed-width values, bounds-checked and swapped in one pass
+		template <class T> void put_array(const T *p, int n) {
+			typedef typename rpc_uint<sizeof(T)>::type U;
+			char *d = reserve(n * sizeof(U));
+			for (int i = 0; i < n; i++) {
+				U y = rpc_hton((U) p[i]);
+				memcpy(d + i * sizeof(U), &y, sizeof(U));
+			}
+			_ind += n * sizeof(U);
+		}
+
+		// Return the current contents (including header and
+		// segments) as a string
 		const std::string str() const {
-			std::string tmps = std::string(_buf,_ind);
+			const std::vector<rpcseg> *segs = _rb ? _rb->segs() : NULL;
+			if (!segs)
+				return std::string(_buf,_ind);
+			std::string tmps;
+			int off = 0;
+			for (unsigned int i = 0; i < segs->size(); i++) {
+				const rpcseg &g = (*segs)[i];
+				tmps.append(_buf + off, g.off - off);
+				tmps.append(g.p, g.len);
+				off = g.off;
+			}
+			tmps.append(_buf + off, _ind - off);
 			return tmps;
 		}
 
-		void pack(int i);
+		void pack(int i) { put(i); }
 
 		void pack_req_header(const req_header &h) {
 			int saved_sz = _ind;
@@ -97,38 +260,61 @@ class marshall {
 #endif
 			pack(h.xid);
 			pack(h.ret);
+			pack((int)h.srv_nonce);
 			_ind = saved_sz;
 		}
 
-		void take_buf(char **b, int *s) {
-			*b = _buf;
+		void take_buf(rpcbuf **b, int *s) {
+			if (!_rb)
+				spill(0);
+			*b = _rb;
 			*s = _ind;
+			_rb = NULL;
 			_buf = NULL;
 			_ind = 0;
 			return;
 		}
 };
-marshall& operator<<(marshall &, unsigned int);
-marshall& operator<<(marshall &, int);
-marshall& operator<<(marshall &, unsigned char);
-marshall& operator<<(marshall &, char);
-marshall& operator<<(marshall &, unsigned short);
-marshall& operator<<(marshall &, short);
-marshall& operator<<(marshall &, unsigned long long);
-marshall& operator<<(marshall &, unsigned long);
+
+//rewrites the server instance in the header of a request already taken
+//out of its marshall.  nothing may be writing b out meanwhile
+inline void
+restamp_req_header(rpcbuf *b, unsigned int srv_nonce)
+{
+	int off = sizeof(rpc_sz_t) + 3 * sizeof(int);
+#if RPC_CHECKSUMMING
+	off += sizeof(rpc_checksum_t);
+#endif
+	uint32_t y = rpc_hton((uint32_t) srv_nonce);
+	memcpy(b->data() + off, &y, sizeof(y));
+}
+inline marshall& operator<<(marshall &m, unsigned int x) { m.put(x); return m; }
+inline marshall& operator<<(marshall &m, int x) { m.put(x); return m; }
+inline marshall& operator<<(marshall &m, unsigned char x) { m.put(x); return m; }
+inline marshall& operator<<(marshall &m, char x) { m.put(x); return m; }
+inline marshall& operator<<(marshall &m, unsigned short x) { m.put(x); return m; }
+inline marshall& operator<<(marshall &m, short x) { m.put(x); return m; }
+inline marshall& operator<<(marshall &m, unsigned long long x) { m.put(x); return m; }
+inline marshall& operator<<(marshall &m, unsigned long x) { m.put(x); return m; }
 marshall& operator<<(marshall &, const std::string &);
+marshall& operator<<(marshall &, std::string &&);
+marshall& operator<<(marshall &, const rpcstr &);
 
 class unmarshall {
 	private:
+		rpcbuf *_rb;
 		char *_buf;
 		int _sz;
 		int _ind;
 		bool _ok;
 	public:
-		unmarshall(): _buf(NULL),_sz(0),_ind(0),_ok(false) {}
-		unmarshall(char *b, int sz): _buf(b),_sz(sz),_ind(),_ok(true) {}
+		unmarshall(): _rb(NULL),_buf(NULL),_sz(0),_ind(0),_ok(false) {}
+		// takes over the caller's reference to b
+		unmarshall(rpcbuf *b, int sz): _rb(b),_buf(b->data()),_sz(sz),_ind(),_ok(true) {}
+		// the sz bytes at pdu, which lie inside b
+		unmarshall(rpcbuf *b, char *pdu, int sz): _rb(b),_buf(pdu),_sz(sz),_ind(),_ok(true) {}
 		~unmarshall() {
-			if (_buf) free(_buf);
+			if (_rb) _rb->decref();
 		}
 		//take contents from another unmarshall object
 		void take_in(unmarshall &another);
@@ -137,16 +323,42 @@ class unmarshall {
 		bool okdone();
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
+		void rawbytes(rpcstr &s, unsigned int n);
+
+		// fixed-width values are bounds-checked once and loaded whole;
+		// past the end they read as 0 and clear ok()
+		template <class T> T get() {
+			typedef typename rpc_uint<sizeof(T)>::type U;
+			U y = 0;
+			if (_ind + (int)sizeof(y) > _sz) {
+				_ok = false;
+				return 0;
+			}
+			memcpy(&y, _buf + _ind, sizeof(y));
+			_ind += sizeof(y);
+			return (T) rpc_ntoh(y);
+		}
+
+		// n fixed-width values, bounds-checked and swapped in one pass
+		template <class T> bool get_array(T *p, unsigned int n) {
+			typedef typename rpc_uint<sizeof(T)>::type U;
+			if (!_ok || n > (unsigned int)(_sz - _ind) / sizeof(U)) {
+				_ok = false;
+				return false;
+			}
+			const char *s = _buf + _ind;
+			for (unsigned int i = 0; i < n; i++) {
+				U y;
+				memcpy(&y, s + i * sizeof(U), sizeof(U));
+				p[i] = (T) rpc_ntoh(y);
+			}
+			_ind += n * sizeof(U);
+			return true;
+		}
 
 		int ind() { return _ind;}
 		int size() { return _sz;}
-		void unpack(int *); //non-const ref
-		void take_buf(char **b, int *sz) {
-			*b = _buf;
-			*sz = _sz;
-			_sz = _ind = 0;
-			_buf = NULL;
-		}
+		void unpack(int *x) { *x = get<int>(); } //non-const ref
 
 		void unpack_req_header(req_header *h) {
 			//the first 4-byte is for channel to fill size of pdu
@@ -170,68 +382,184 @@ class unmarshall {
 #endif
 			unpack(&h->xid);
 			unpack(&h->ret);
+			unpack((int *)&h->srv_nonce);
 			_ind = RPC_HEADER_SZ;
 		}
 };
 
-unmarshall& operator>>(unmarshall &, unsigned char &);
-unmarshall& operator>>(unmarshall &, char &);
-unmarshall& operator>>(unmarshall &, unsigned short &);
-unmarshall& operator>>(unmarshall &, short &);
-unmarshall& operator>>(unmarshall &, unsigned int &);
-unmarshall& operator>>(unmarshall &, int &);
-unmarshall& operator>>(unmarshall &, unsigned long long &);
-unmarshall& operator>>(unmarshall &, unsigned long &);
+inline unmarshall& operator>>(unmarshall &u, unsigned char &x) { x = u.get<unsigned char>(); return u; }
+inline unmarshall& operator>>(unmarshall &u, char &x) { x = u.get<char>(); return u; }
+inline unmarshall& operator>>(unmarshall &u, unsigned short &x) { x = u.get<unsigned short>(); return u; }
+inline unmarshall& operator>>(unmarshall &u, short &x) { x = u.get<short>(); return u; }
+inline unmarshall& operator>>(unmarshall &u, unsigned int &x) { x = u.get<unsigned int>(); return u; }
+inline unmarshall& operator>>(unmarshall &u, int &x) { x = u.get<int>(); return u; }
+inline unmarshall& operator>>(unmarshall &u, unsigned long long &x) { x = u.get<unsigned long long>(); return u; }
+inline unmarshall& operator>>(unmarshall &u, unsigned long &x) { x = u.get<unsigned long>(); return u; }
 unmarshall& operator>>(unmarshall &, std::string &);
+unmarshall& operator>>(unmarshall &, rpcstr &);
 
-template <class C> marshall &
-operator<<(marshall &m, std::vector<C> v)
+template <class C> void
+marshall_elems(marshall &m, const std::vector<C> &v, std::false_type)
 {
-	m << (unsigned int) v.size();
 	for(unsigned i = 0; i < v.size(); i++)
 		m << v[i];
+}
+
+template <class C> void
+marshall_elems(marshall &m, const std::vector<C> &v, std::true_type)
+{
+	m.put_array(v.data(), v.size());
+}
+
+template <class C> marshall &
+operator<<(marshall &m, const std::vector<C> &v)
+{
+	m << (unsigned int) v.size();
+	marshall_elems(m, v, rpc_fixed<C>());
 	return m;
 }
 
+// each element takes at least a byte on the wire, so a length claiming
+// more than the bytes left is bogus; never reserve more than that
+inline unsigned
+unmarshall_bound(unmarshall &u, unsigned n)
+{
+	unsigned left = u.size() - u.ind();
+	return n < left ? n : left;
+}
+
+template <class C> void
+unmarshall_elems(unmarshall &u, std::vector<C> &v, unsigned n, std::false_type)
+{
+	v.reserve(v.size() + unmarshall_bound(u, n));
+	for(unsigned i = 0; i < n && u.ok(); i++){
+		v.emplace_back();
+		u >> v.back();
+	}
+	if (!u.ok())
+		v.pop_back();
+}
+
+template <class C> void
+unmarshall_elems(unmarshall &u, std::vector<C> &v, unsigned n, std::true_type)
+{
+	//check n against the bytes left before sizing v by it
+	if (n > (unsigned)(u.size() - u.ind()) / sizeof(C)) {
+		u.get_array((C *) NULL, n);
+		return;
+	}
+	unsigned old = v.size();
+	v.resize(old + n);
+	u.get_array(v.data() + old, n);
+}
+
 template <class C> unmarshall &
 operator>>(unmarshall &u, std::vector<C> &v)
 {
 	unsigned n;
 	u >> n;
-	for(unsigned i = 0; i < n; i++){
-		C z;
-		u >> z;
-		v.push_back(z);
-	}
+	if (u.ok())
+		unmarshall_elems(u, v, n, rpc_fixed<C>());
 	return u;
 }
 
-template <class A, class B> marshall &
-operator<<(marshall &m, const std::map<A,B> &d) {
-	typename std::map<A,B>::const_iterator i;
-
+// maps and sets, ordered or not, go out as a count and their elements
+// in iteration order
+template <class M> marshall &
+marshall_pairs(marshall &m, const M &d)
+{
 	m << (unsigned int) d.size();
-
-	for (i = d.begin(); i != d.end(); i++) {
+	for (typename M::const_iterator i = d.begin(); i != d.end(); i++)
 		m << i->first << i->second;
+	return m;
+}
+
+template <class M> unmarshall &
+unmarshall_pairs(unmarshall &u, M &d, unsigned n)
+{
+	for (unsigned int lcv = 0; lcv < n && u.ok(); lcv++) {
+		typename M::key_type a;
+		typename M::mapped_type b;
+		u >> a >> b;
+		if (u.ok())
+			d[std::move(a)] = std::move(b);
 	}
+	return u;
+}
+
+template <class S> marshall &
+marshall_keys(marshall &m, const S &d)
+{
+	m << (unsigned int) d.size();
+	for (typename S::const_iterator i = d.begin(); i != d.end(); i++)
+		m << *i;
 	return m;
 }
 
+template <class S> unmarshall &
+unmarshall_keys(unmarshall &u, S &d, unsigned n)
+{
+	for (unsigned int lcv = 0; lcv < n && u.ok(); lcv++) {
+		typename S::key_type a;
+		u >> a;
+		if (u.ok())
+			d.insert(std::move(a));
+	}
+	return u;
+}
+
+template <class A, class B> marshall &
+operator<<(marshall &m, const std::map<A,B> &d) {
+	return marshall_pairs(m, d);
+}
+
 template <class A, class B> unmarshall &
 operator>>(unmarshall &u, std::map<A,B> &d) {
 	unsigned int n;
 	u >> n;
+	d.clear();
+	return unmarshall_pairs(u, d, n);
+}
+
+template <class A, class B> marshall &
+operator<<(marshall &m, const std::unordered_map<A,B> &d) {
+	return marshall_pairs(m, d);
+}
 
+template <class A, class B> unmarshall &
+operator>>(unmarshall &u, std::unordered_map<A,B> &d) {
+	unsigned int n;
+	u >> n;
 	d.clear();
+	d.reserve(unmarshall_bound(u, n));
+	return unmarshall_pairs(u, d, n);
+}
 
-	for (unsigned int lcv = 0; lcv < n; lcv++) {
-		A a;
-		B b;
-		u >> a >> b;
-		d[a] = b;
-	}
-	return u;
+template <class A> marshall &
+operator<<(marshall &m, const std::set<A> &d) {
+	return marshall_keys(m, d);
+}
+
+template <class A> unmarshall &
+operator>>(unmarshall &u, std::set<A> &d) {
+	unsigned int n;
+	u >> n;
+	d.clear();
+	return unmarshall_keys(u, d, n);
+}
+
+template <class A> marshall &
+operator<<(marshall &m, const std::unordered_set<A> &d) {
+	return marshall_keys(m, d);
+}
+
+template <class A> unmarshall &
+operator>>(unmarshall &u, std::unordered_set<A> &d) {
+	unsigned int n;
+	u >> n;
+	d.clear();
+	d.reserve(unmarshall_bound(u, n));
+	return unmarshall_keys(u, d, n);
 }
 
 #endif
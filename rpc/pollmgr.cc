@@ -2,6 +2,8 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <stdlib.h>
+#include <atomic>
 
 #include "slock.h"
 #include "jsl_log.h"
@@ -10,12 +12,32 @@
 #include "pollmgr.h"
 
 PollMgr *PollMgr::instance = NULL;
+std::vector<PollMgr *> PollMgr::reactors;
 static pthread_once_t pollmgr_is_initialized = PTHREAD_ONCE_INIT;
+static std::atomic<unsigned int> next_reactor(0);
 
 void
 PollMgrInit()
 {
-	PollMgr::instance = new PollMgr();
+	int n = 0;
+	char *env = getenv("RPC_REACTORS");
+	if (env != NULL) {
+		n = atoi(env);
+	}
+	if (n <= 0) {
+		n = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (n <= 0) {
+		n = 1;
+	} else if (n > MAX_REACTORS) {
+		n = MAX_REACTORS;
+	}
+
+	for (int i = 0; i < n; i++) {
+		PollMgr::reactors.push_back(new PollMgr());
+	}
+	PollMgr::instance = PollMgr::reactors[0];
+	jsl_log(JSL_DBG_2, "PollMgr: %d reactors\n", n);
 }
 
 PollMgr *
@@ -25,11 +47,29 @@ PollMgr::Instance()
 	return instance;
 }
 
+//picks the reactor for a new connection.  all callbacks of an fd
+//must go through the PollMgr it was assigned to
+PollMgr *
+PollMgr::Assign()
+{
+	pthread_once(&pollmgr_is_initialized, PollMgrInit);
+	return reactors[next_reactor++ % reactors.size()];
+}
+
+int
+PollMgr::nreactors()
+{
+	pthread_once(&pollmgr_is_initialized, PollMgrInit);
+	return reactors.size();
+}
+
 PollMgr::PollMgr() : pending_change_(false)
 {
-	bzero(callbacks_, MAX_POLL_FDS*sizeof(void *));
+#ifdef __linux__
+	aio_ = new EPollAIO();
+#else
 	aio_ = new SelectAIO();
-	//aio_ = new EPollAIO();
+#endif
 
 	assert(pthread_mutex_init(&m_, NULL) == 0);
 	assert(pthread_cond_init(&changedone_c_, NULL) == 0);
@@ -45,11 +85,11 @@ PollMgr::~PollMgr()
 void
 PollMgr::add_callback(int fd, poll_flag flag, aio_callback *ch)
 {
-	assert(fd < MAX_POLL_FDS);
-
 	ScopedLock ml(&m_);
 	aio_->watch_fd(fd, flag);
 
+	if (fd >= (int)callbacks_.size())
+		callbacks_.resize(fd + 1, NULL);
 	assert(!callbacks_[fd] || callbacks_[fd]==ch);
 	callbacks_[fd] = ch;
 }
@@ -64,14 +104,15 @@ PollMgr::block_remove_fd(int fd)
 	aio_->unwatch_fd(fd, CB_RDWR);
 	pending_change_ = true;
 	assert(pthread_cond_wait(&changedone_c_, &m_)==0);
-	callbacks_[fd] = NULL;
+	if (fd < (int)callbacks_.size())
+		callbacks_[fd] = NULL;
 }
 
 void
 PollMgr::del_callback(int fd, poll_flag flag)
 {
 	ScopedLock ml(&m_);
-	if (aio_->unwatch_fd(fd, flag)) {
+	if (aio_->unwatch_fd(fd, flag) && fd < (int)callbacks_.size()) {
 		callbacks_[fd] = NULL;
 	}
 }
@@ -80,7 +121,7 @@ bool
 PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
 {
 	ScopedLock ml(&m_);
-	if (!callbacks_[fd] || callbacks_[fd]!=c)
+	if (fd >= (int)callbacks_.size() || !callbacks_[fd] || callbacks_[fd]!=c)
 		return false;
 
 	return aio_->is_watched(fd, flag);
@@ -92,6 +133,8 @@ PollMgr::wait_loop()
 
 	std::vector<int> readable;
 	std::vector<int> writable;
+	std::vector<aio_callback *> rcbs;
+	std::vector<aio_callback *> wcbs;
 
 	while (1) {
 		{
@@ -108,19 +151,32 @@ PollMgr::wait_loop()
 		if (!readable.size() && !writable.size()) {
 			continue;
 		} 
-		//no locking of m_
-		//because no add_callback() and del_callback should 
-		//modify callbacks_[fd] while the fd is not dead
+		//look the callbacks up under m_ because add_callback()
+		//may grow callbacks_, but call them without it: no
+		//add_callback() and del_callback should change callbacks_[fd]
+		//while the fd is not dead
+		rcbs.clear();
+		wcbs.clear();
+		{
+			ScopedLock ml(&m_);
+			for (unsigned int i = 0; i < readable.size(); i++) {
+				int fd = readable[i];
+				rcbs.push_back(fd < (int)callbacks_.size() ? callbacks_[fd] : NULL);
+			}
+			for (unsigned int i = 0; i < writable.size(); i++) {
+				int fd = writable[i];
+				wcbs.push_back(fd < (int)callbacks_.size() ? callbacks_[fd] : NULL);
+			}
+		}
+
 		for (unsigned int i = 0; i < readable.size(); i++) {
-			int fd = readable[i];
-			if (callbacks_[fd])
-				callbacks_[fd]->read_cb(fd);
+			if (rcbs[i])
+				rcbs[i]->read_cb(readable[i]);
 		}
 
 		for (unsigned int i = 0; i < writable.size(); i++) {
-			int fd = writable[i];
-			if (callbacks_[fd])
-				callbacks_[fd]->write_cb(fd);
+			if (wcbs[i])
+				wcbs[i]->write_cb(writable[i]);
 		}
 	}
 }
@@ -149,6 +205,9 @@ SelectAIO::~SelectAIO()
 void
 SelectAIO::watch_fd(int fd, poll_flag flag)
 {
+	//select cannot wait on fds beyond FD_SETSIZE; use EPollAIO for more
+	assert(fd < FD_SETSIZE);
+
 	ScopedLock ml(&m_);
 	if (highfds_ <= fd) 
 		highfds_ = fd;
@@ -260,34 +319,33 @@ SelectAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 
 EPollAIO::EPollAIO()
 {
-	pollfd_ = epoll_create(MAX_POLL_FDS);
+	pollfd_ = epoll_create(MAX_POLL_EVENTS);
 	assert(pollfd_ >= 0);
-	bzero(fdstatus_, sizeof(int)*MAX_POLL_FDS);
+
+	//block_remove_fd() writes to the pipe to wake up epoll_wait
+	assert(pipe(pipefd_) == 0);
+	int flags = fcntl(pipefd_[0], F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(pipefd_[0], F_SETFL, flags);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN | EPOLLET;
+	ev.data.fd = pipefd_[0];
+	assert(epoll_ctl(pollfd_, EPOLL_CTL_ADD, pipefd_[0], &ev) == 0);
 }
 
 EPollAIO::~EPollAIO()
 {
 	close(pollfd_);
-}
-
-static inline
-int poll_flag_to_event(poll_flag flag)
-{
-	int f;
-	if (flag == CB_RDONLY) {
-		f = EPOLLIN;
-	}else if (flag == CB_WRONLY) {
-		f = EPOLLOUT;
-	}else { //flag == CB_RDWR
-		f = EPOLLIN | EPOLLOUT;
-	}
-	return f;
+	close(pipefd_[0]);
+	close(pipefd_[1]);
 }
 
 void
 EPollAIO::watch_fd(int fd, poll_flag flag)
 {
-	assert(fd < MAX_POLL_FDS);
+	if (fd >= (int)fdstatus_.size())
+		fdstatus_.resize(fd + 1, 0);
 
 	struct epoll_event ev;
 	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
@@ -313,7 +371,15 @@ EPollAIO::watch_fd(int fd, poll_flag flag)
 bool 
 EPollAIO::unwatch_fd(int fd, poll_flag flag)
 {
-	assert(fd < MAX_POLL_FDS);
+	if (flag == CB_RDWR) {
+		char tmp = 1;
+		assert(write(pipefd_[1], &tmp, sizeof(tmp))==1);
+	}
+
+	//a connection that failed has already been unwatched
+	if (fd >= (int)fdstatus_.size() || !fdstatus_[fd])
+		return true;
+
 	fdstatus_[fd] &= ~(int)flag;
 
 	struct epoll_event ev;
@@ -339,20 +405,41 @@ EPollAIO::unwatch_fd(int fd, poll_flag flag)
 bool
 EPollAIO::is_watched(int fd, poll_flag flag)
 {
-	assert(fd < MAX_POLL_FDS);
-	return ((fdstatus_[fd] & CB_MASK) == flag);
+	if (fd >= (int)fdstatus_.size())
+		return false;
+	return ((fdstatus_[fd] & (int)flag) == (int)flag);
 }
 
+//fds are watched edge-triggered: the callbacks must read and write
+//until the socket would block
 void
 EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 {
-	int nfds = epoll_wait(pollfd_, ready_,	MAX_POLL_FDS, -1);
+	int nfds = epoll_wait(pollfd_, ready_, MAX_POLL_EVENTS, -1);
+	if (nfds < 0) {
+		if (errno == EINTR) {
+			return;
+		} else {
+			perror("epoll_wait:");
+			jsl_log(JSL_DBG_OFF, "PollMgr::epoll_loop failure errno %d\n",errno);
+			assert(0);
+		}
+	}
+
 	for (int i = 0; i < nfds; i++) {
-		if (ready_[i].events & EPOLLIN) {
-			readable->push_back(ready_[i].data.fd);
+		int fd = ready_[i].data.fd;
+		if (fd == pipefd_[0]) {
+			char tmp[64];
+			while (read(pipefd_[0], tmp, sizeof(tmp)) > 0)
+				;
+			continue;
+		}
+		//errors and hangups surface through the read callback
+		if (ready_[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+			readable->push_back(fd);
 		}
 		if (ready_[i].events & EPOLLOUT) {
-			writable->push_back(ready_[i].data.fd);
+			writable->push_back(fd);
 		}
 	}
 }
@@ -8,7 +8,8 @@
 #include <sys/epoll.h>
 #endif
 
-#define MAX_POLL_FDS 128
+#define MAX_POLL_EVENTS 1024 //maximum number of events per epoll_wait
+#define MAX_REACTORS 16 //maximum number of PollMgr threads
 
 typedef enum {
 	CB_NONE = 0x0,
@@ -34,6 +35,10 @@ class aio_callback {
 		virtual ~aio_callback() {}
 };
 
+// each PollMgr is a reactor: one thread waiting on its own set of fds.
+// the process has RPC_REACTORS of them (default: one per cpu) and each
+// connection is assigned to one for its lifetime, round-robin, so IO
+// on different connections runs in parallel.
 class PollMgr {
 	public:
 		PollMgr();
@@ -41,6 +46,8 @@ class PollMgr {
 
 		static PollMgr *Instance();
 		static PollMgr *CreateInst();
+		static PollMgr *Assign();
+		static int nreactors();
 
 		void add_callback(int fd, poll_flag flag, aio_callback *ch);
 		void del_callback(int fd, poll_flag flag);
@@ -50,6 +57,7 @@ class PollMgr {
 
 
 		static PollMgr *instance;
+		static std::vector<PollMgr *> reactors;
 		static int useful;
 		static int useless;
 
@@ -58,7 +66,7 @@ class PollMgr {
 		pthread_cond_t changedone_c_;
 		pthread_t th_;
 
-		aio_callback *callbacks_[MAX_POLL_FDS];
+		std::vector<aio_callback *> callbacks_; //indexed by fd, grows as needed
 		aio_mgr *aio_;
 		bool pending_change_;
 
@@ -97,8 +105,9 @@ class EPollAIO : public aio_mgr {
 
 	private:
 		int pollfd_;
-		struct epoll_event ready_[MAX_POLL_FDS];
-		int fdstatus_[MAX_POLL_FDS];
+		int pipefd_[2];
+		struct epoll_event ready_[MAX_POLL_EVENTS];
+		std::vector<int> fdstatus_; //indexed by fd, grows as needed
 
 };
 #endif /* __linux */
@@ -11,24 +11,32 @@
 
  Both rpcc and rpcs class use connection class as an abstraction for the
  underlying communication channel.  To send an RPC request/reply, one calls
- connection::send() which blocks until data is sent or connection has failed
- (thus caller can safely free the buffer occupied by send() arguments).  When a
+ connection::send() which queues a reference to the reference-counted buffer
+ (rpcbuf) and returns; the PollMgr thread writes queued PDUs out with writev,
+ so concurrent senders on a connection do not wait for each other.  When a
  request/reply is received, connection makes a callback into the corresponding
  rpcc or rpcs (see rpcc::got_pdu() and rpcs::got_pdu()).
 
  Thread organization:
  rpcc uses application threads to send RPC requests and blocks to receive the
- rely or error. All connections use a single PollMgr object to perform async
- socket IO.  PollMgr creates a single thread to examine the readiness of socket
- file descriptors and informs the corresponding connection whenever a socket is
- ready to be read or written.  (We use asynchronous socket IO to reduce the
- number of threads needed to manage these connections; without async IO, at
- least one thread is needed per connection to read data without blocking other
- activities.)  Each rpcs object creates one thread for listening on the server
- port and a thread pool of x > 1 threads for executing RPC requests.  Using the
- thread pool allows us to control the number of threads spawned at the server
- (Spawning one thread per request will hurt when the server faces thousands of
- requests)
+ rely or error. Asynchronous calls (rpcc::async_call1) instead return once the
+ request is sent; the PollMgr thread completes them when the reply arrives.  A
+ single TimerMgr thread handles the retransmissions and deadlines of both
+ kinds, waking blocked callers when their time is up.  rpcc connects to its
+ server the same way: the connect completes in the PollMgr loop, callers wait
+ for it like for a reply, and failed connects back off before the next try.
+ Connections use PollMgr objects to perform async socket IO.  Each PollMgr
+ (reactor) has one thread that examines the readiness of its socket file
+ descriptors and informs the corresponding connection whenever a socket is
+ ready to be read or written; a process runs RPC_REACTORS of them (one per cpu
+ by default) and spreads connections over them round-robin.  (We use
+ asynchronous socket IO to reduce the number of threads needed to manage these
+ connections; without async IO, at least one thread is needed per connection
+ to read data without blocking other activities.)  Each rpcs object creates
+ one thread for listening on the server port and a thread pool of x > 1
+ threads for executing RPC requests.  Using the thread pool allows us to
+ control the number of threads spawned at the server (Spawning one thread per
+ request will hurt when the server faces thousands of requests)
 
  In order to delete a connection object, we must maintain reference count to
  ensure that there are no outstanding references to a to-be-deleted object. For rpcc,
@@ -68,23 +76,34 @@
 #include <arpa/inet.h>
 #include <netinet/tcp.h>
 #include <time.h>
+#include <string.h>
+#include <sched.h>
 #include <netdb.h>
+#ifdef __linux__
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#endif
 
 #include "jsl_log.h"
 #include "gettime.h"
 
+#define REPLY_CLIENT_BYTES (16<<20) //default budget of a client's cached replies
+#define REPLY_TOTAL_BYTES (256<<20) //default budget of all cached replies
+#define SESSION_TTL_MS (10*60*1000) //default idle time before a session expires
+#define RTO_MIN_MS 10 //lower bound of the retransmission timeout
+#define CONNECT_TIMEOUT_MS 5000 //longest a connect may take
+#define BACKOFF_MIN_MS 20 //reconnect delay after the first failed connect
+#define BACKOFF_MAX_MS 5000 //upper bound of the reconnect delay
+#define BREAKER_FAILURES 5 //failures in a row that open the circuit breaker
+#define BREAKER_OPEN_MS 1000 //time between probes of an open breaker
+
 const rpcc::TO rpcc::to_max = {120000};
 const rpcc::TO rpcc::to_min = {1000};
 
-rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-        : xid(xxid), un(xun), done(false) {
-    assert(pthread_mutex_init(&m, 0) == 0);
-    assert(pthread_cond_init(&c, 0) == 0);
-}
-
-rpcc::caller::~caller() {
-    assert(pthread_mutex_destroy(&m) == 0);
-    assert(pthread_cond_destroy(&c) == 0);
+rpcc::caller::caller()
+        : xid(0), intret(0), refs(0), req(NULL), reqsz(0), ch(NULL),
+          deadline(0), sent_us(0), sends(0), connects(0), unbound(false),
+          unbound_on(0), transmitting(false), curr_to(0), timer(0) {
 }
 
 inline void set_rand_seed() {
@@ -93,11 +112,74 @@ inline void set_rand_seed() {
     srandom((int) ts.tv_nsec ^ ((int) getpid()));
 }
 
+// milliseconds on the monotonic clock
+static long long now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// microseconds on the monotonic clock
+static long long now_us() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+// sleeps while *w is val; may return early
+static void futex_wait(std::atomic<int> *w, int val) {
+#ifdef __linux__
+    syscall(SYS_futex, (int *) w, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+#else
+    // no futexes: poll
+    struct timespec ts = {0, 50000};
+    if (w->load() == val)
+        nanosleep(&ts, NULL);
+#endif
+}
+
+static void futex_wake(std::atomic<int> *w) {
+#ifdef __linux__
+    syscall(SYS_futex, (int *) w, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+#endif
+}
+
+// how long a caller polls for its reply before it sleeps: RPC_SPIN
+// iterations, by default some on a multiprocessor and none otherwise
+static int call_spins() {
+    static int spins = -1;
+    if (spins < 0) {
+        char *spin_env = getenv("RPC_SPIN");
+        if (spin_env != NULL)
+            spins = atoi(spin_env);
+        else
+            spins = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? 2000 : 0;
+    }
+    return spins;
+}
+
+static inline void cpu_relax() {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
 rpcc::rpcc(sockaddr_in d, bool retrans) :
-        dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0),
-        retrans_(retrans), chan_(NULL) {
+        dst_(d), srv_nonce_(0), bind_done_(false), bound_on_(0), xid_(1),
+        lossytest_(0), retrans_(retrans), chan_(NULL), srtt_us_(0),
+        rttvar_us_(0), failover_timer_(0), failover_pending_(false),
+        closing_(false), failovers_(0), connecting_(false), chan_closing_(false),
+        connected_once_(false), connect_fails_(0), next_connect_ms_(0),
+        connect_timer_(0), connects_(0), failed_connect_(0),
+        breaker_(BREAKER_CLOSED), breaker_fails_(0), breaker_probe_ms_(0),
+        breaker_trips_(0) {
     assert(pthread_mutex_init(&m_, 0) == 0);
+    assert(pthread_mutex_init(&breaker_m_, 0) == 0);
     assert(pthread_mutex_init(&chan_m_, 0) == 0);
+    assert(pthread_cond_init(&connect_c_, 0) == 0);
+    assert(pthread_mutex_init(&xid_rep_m_, 0) == 0);
+    for (unsigned int i = 0; i < CALL_SLOTS / CALL_SEG; i++)
+        slots_[i].store(NULL);
 
     if (retrans) {
         set_rand_seed();
@@ -115,7 +197,8 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
     }
 
     //xid starts with 1 and latest received reply starts with 0
-    xid_rep_window_.push_back(0);
+    xid_rep_ = 0;
+    memset(xid_rep_bits_, 0, sizeof(xid_rep_bits_));
 
     jsl_log(JSL_DBG_2, "rpcc::rpcc cltn_nonce is %d lossy %d\n",
             clt_nonce_, lossytest_);
@@ -126,22 +209,59 @@ rpcc::rpcc(sockaddr_in d, bool retrans) :
 rpcc::~rpcc() {
     jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n",
             clt_nonce_, chan_ ? chan_->channo() : -1);
+    // a failover could open a new channel, so stop it first
+    TimerMgr::timer_id f;
+    {
+        ScopedLock ml(&m_);
+        closing_ = true;
+        f = failover_timer_;
+    }
+    if (f)
+        TimerMgr::Instance()->cancel(f);
+    // nor may a connect in flight, or one after a backoff
+    {
+        ScopedLock ml(&chan_m_);
+        chan_closing_ = true;
+        while (connecting_)
+            assert(pthread_cond_wait(&connect_c_, &chan_m_) == 0);
+        f = connect_timer_;
+    }
+    if (f)
+        TimerMgr::Instance()->cancel(f);
     if (chan_) {
         chan_->closeconn();
         chan_->decref();
     }
-    assert(calls_.size() == 0);
+    // wait out timer callbacks that may still look at this rpcc
+    std::map<unsigned int, TimerMgr::timer_id> zombies;
+    {
+        ScopedLock ml(&m_);
+        zombies = zombie_timers_;
+    }
+    std::map<unsigned int, TimerMgr::timer_id>::iterator z;
+    for (z = zombies.begin(); z != zombies.end(); z++)
+        TimerMgr::Instance()->cancel(z->second);
+    for (unsigned int i = 0; i < CALL_SLOTS / CALL_SEG; i++) {
+        slot_t *seg = slots_[i].load();
+        if (!seg)
+            continue;
+        for (unsigned int j = 0; j < CALL_SEG; j++)
+            assert(seg[j].tag.load() == 0);
+        delete[] seg;
+    }
     assert(pthread_mutex_destroy(&m_) == 0);
+    assert(pthread_mutex_destroy(&breaker_m_) == 0);
     assert(pthread_mutex_destroy(&chan_m_) == 0);
+    assert(pthread_cond_destroy(&connect_c_) == 0);
+    assert(pthread_mutex_destroy(&xid_rep_m_) == 0);
 }
 
 int rpcc::bind(TO to) {
     int r;
     int ret = call(rpc_const::bind, 0, r, to);
     if (ret == 0) {
-        ScopedLock ml(&m_);
-        bind_done_ = true;
         srv_nonce_ = r;
+        bind_done_ = true;
     } else {
         jsl_log(JSL_DBG_2, "rpcc::bind %s failed %d\n",
                 inet_ntoa(dst_.sin_addr), ret);
@@ -149,123 +269,731 @@ int rpcc::bind(TO to) {
     return ret;
 };
 
-int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
-                TO to) {
+rpcc::slot_t *rpcc::find_slot(unsigned int xid) {
+    unsigned int i = xid % CALL_SLOTS;
+    slot_t *seg = slots_[i / CALL_SEG].load();
+    return seg ? &seg[i % CALL_SEG] : NULL;
+}
 
-    caller ca(0, &rep);
-    {
-        ScopedLock ml(&m_);
+unsigned int rpcc::claim_slot(slot_t **slp, caller *ca, unmarshall *un) {
+    unsigned int xid = xid_++;
+    unsigned int i = xid % CALL_SLOTS;
+    slot_t *seg = slots_[i / CALL_SEG].load();
+    if (!seg) {
+        slot_t *n = new slot_t[CALL_SEG];
+        for (unsigned int j = 0; j < CALL_SEG; j++) {
+            n[j].tag.store(0);
+            n[j].seq.store(0);
+            n[j].parked.store(0);
+            n[j].kicks.store(0);
+            n[j].ca.store(NULL);
+            n[j].un = NULL;
+            n[j].intret = 0;
+        }
+        if (slots_[i / CALL_SEG].compare_exchange_strong(seg, n))
+            seg = n;
+        else
+            delete[] n;
+    }
 
-        if ((proc != rpc_const::bind && !bind_done_) ||
-            (proc == rpc_const::bind && bind_done_)) {
-            jsl_log(JSL_DBG_1, "rpcc::call1 rpcc has not been bound to dst or binding twice\n");
-            return rpc_const::bind_failure;
+    // reserve the slot, fill it in, then let got_pdu see it.  a call
+    // CALL_SLOTS xids older may still hold the slot: wait for it rather
+    // than skip xids, which would let xid_rep run ahead of pending calls
+    slot_t *sl = &seg[i % CALL_SEG];
+    for (unsigned int tries = 0; ; tries++) {
+        uint64_t t = 0;
+        if (sl->tag.compare_exchange_strong(t, slot_tag(xid, SLOT_CLAIMED)))
+            break;
+        if (tries < 100)
+            sched_yield();
+        else
+            usleep(1000);
+    }
+    sl->ca.store(ca);
+    sl->un = un;
+    sl->intret = 0;
+    sl->tag.store(slot_tag(xid, SLOT_WAITING));
+    *slp = sl;
+    return xid;
+}
+
+void rpcc::release_slot(slot_t *sl) {
+    sl->ca.store(NULL);
+    sl->un = NULL;
+    sl->tag.store(0);
+}
+
+bool rpcc::wait_slot(slot_t *sl, unsigned int xid, int ms) {
+    uint64_t done = slot_tag(xid, SLOT_DONE);
+    for (int i = call_spins(); i > 0; i--) {
+        if (sl->tag.load() == done)
+            return true;
+        cpu_relax();
+    }
+
+    unsigned int kicks = sl->kicks.load();
+    TimerMgr::timer_id t = 0;
+    if (ms >= 0) {
+        t = TimerMgr::Instance()->schedule(ms, [sl]() { kick_slot(sl); });
+    }
+
+    bool ok = true;
+    while (1) {
+        // done_slot and the timer change the tag or kicks before seq, so
+        // if they run after this load, futex_wait does not sleep
+        int seq = sl->seq.load();
+        if (sl->tag.load() == done)
+            break;
+        if (sl->kicks.load() != kicks) {
+            ok = false;
+            break;
         }
+        sl->parked.store(1);
+        futex_wait(&sl->seq, seq);
+    }
+    sl->parked.store(0);
+
+    // the timer must be done with sl before it is reused
+    if (t)
+        TimerMgr::Instance()->cancel(t);
+    return ok;
+}
+
+void rpcc::done_slot(slot_t *sl, unsigned int xid) {
+    sl->tag.store(slot_tag(xid, SLOT_DONE));
+    sl->seq++;
+    if (sl->parked.exchange(0) == 1)
+        futex_wake(&sl->seq);
+}
 
-        ca.xid = xid_++;
-        calls_[ca.xid] = &ca;
+void rpcc::kick_slot(slot_t *sl) {
+    sl->kicks++;
+    sl->seq++;
+    futex_wake(&sl->seq);
+}
+
+unsigned int rpcc::xid_rep() {
+    ScopedLock xl(&xid_rep_m_);
+    return xid_rep_;
+}
+
+int rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
+                TO to) {
 
-        req_header h(ca.xid, proc, clt_nonce_, srv_nonce_, xid_rep_window_.front());
-        req.pack_req_header(h);
+    if (proc == rpc_const::bind && bind_done_) {
+        jsl_log(JSL_DBG_1, "rpcc::call1 rpcc binding twice\n");
+        return rpc_const::bind_failure;
     }
 
+    if (!breaker_admit())
+        return rpc_const::unavailable_failure;
 
-    TO curr_to;
-    struct timespec now, nextdeadline, finaldeadline;
+    slot_t *sl;
+    unsigned int xid = claim_slot(&sl, NULL, &rep);
+    // before the client is bound, the request names no server instance
+    // and its reply binds the client
+    unsigned int srv_nonce = srv_nonce_.load();
+    req_header h(xid, proc, clt_nonce_, srv_nonce, xid_rep());
+    req.pack_req_header(h);
 
-    clock_gettime(CLOCK_REALTIME, &now);
-    add_timespec(now, to.to, &finaldeadline);
-    curr_to.to = to_min.to;
+    long long finaldeadline = now_ms() + to.to;
+    int curr_to = rto();
+    long long sent_us = 0;
+    int sends = 0;
+    unsigned long long unbound_on = 0;
+    unsigned int connects = connects_.load();
 
     bool transmit = true;
     connection *ch = NULL;
+    bool done = false;
+    int failure = rpc_const::timeout_failure;
 
     while (1) {
 
         if (transmit) {
+            if (breaker_open()) {
+                //dst failed since the call was issued: don't wait for
+                //a connection that isn't coming
+                failure = rpc_const::unavailable_failure;
+                break;
+            }
             get_refconn(&ch);
+            if (ch && !srv_nonce && proc != rpc_const::bind) {
+                //bind itself is safe to repeat
+                unsigned int stamp;
+                if (!unbound_resend(unbound_on, ch->serial(), &stamp)) {
+                    failure = rpc_const::oldsrv_failure;
+                    break;
+                }
+                if (stamp) {
+                    srv_nonce = stamp;
+                    restamp_req_header(req.buf(), srv_nonce);
+                }
+            }
             if (ch) {
-                ch->send(req.cstr(), req.size());
+                if (!sends++)
+                    sent_us = now_us();
+                //a failed send never got the whole request out, and the
+                //server only runs whole requests
+                if (ch->send(req.buf(), req.size()) && !srv_nonce)
+                    unbound_on = ch->serial();
                 jsl_log(JSL_DBG_2,
                         "rpcc::call1 %u just sent req proc %x xid %u clt_nonce %d\n",
-                        clt_nonce_, proc, ca.xid, clt_nonce_);
+                        clt_nonce_, proc, xid, clt_nonce_);
+            } else if (!sends && failed_connect_.load() > connects) {
+                //a connect begun since the call was issued failed and the
+                //request never went out: fail fast
+                failure = rpc_const::conn_failure;
+                break;
             }
             transmit = false; //only send once on a given channel
         }
 
-        if (!finaldeadline.tv_sec)
+        long long left = finaldeadline - now_ms();
+        if (left <= 0)
             break;
 
-        clock_gettime(CLOCK_REALTIME, &now);
-        add_timespec(now, curr_to.to, &nextdeadline);
-        if (cmp_timespec(nextdeadline, finaldeadline) > 0) {
-            nextdeadline = finaldeadline;
-            finaldeadline.tv_sec = 0;
-        }
-
-        {
-            ScopedLock cal(&ca.m);
-            while (!ca.done) {
-                if (pthread_cond_timedwait(&ca.c, &ca.m, &nextdeadline) == ETIMEDOUT)
-                    break;
-            }
-            if (ca.done)
-                break;
-        }
+        if ((done = wait_slot(sl, xid, curr_to < left ? curr_to : left)))
+            break;
 
-        if (retrans_ && (!ch || ch->isdead())) {
+        if (!ch || (retrans_ && ch->isdead())) {
             //since connection is dead, we retransmit on the new connection
             transmit = true;
         }
-        curr_to.to <<= 1;
+        curr_to <<= 1;
     }
 
+    if (!done) {
+        // give up on the reply, unless got_pdu is already delivering it
+        uint64_t t = slot_tag(xid, SLOT_WAITING);
+        if (!sl->tag.compare_exchange_strong(t, slot_tag(xid, SLOT_CLAIMED)))
+            done = wait_slot(sl, xid, -1);
+    }
+    int intret = sl->intret;
+    release_slot(sl);
+    // Karn: the reply to a retransmitted request may answer either copy
+    if (done && sends == 1)
+        rtt_sample(now_us() - sent_us);
+    // a failed connect was counted when it failed
+    if (done || failure == rpc_const::timeout_failure)
+        breaker_result(done);
+
     {
-        ScopedLock ml(&m_); //no locking of ca.m because no one but this thread changes ca.xid
-        calls_.erase(ca.xid);
+        ScopedLock xl(&xid_rep_m_);
         // we potentially need to update the xid again here, in case the
         // packet times out before it's even sent by the channel.  nasty.
         // but I don't think there's any harm in potentially doing it twice
-        update_xid_rep(ca.xid);
+        update_xid_rep(xid);
     }
 
-    ScopedLock cal(&ca.m);
-
     jsl_log(JSL_DBG_2,
             "rpcc::call1 %u wait over for req proc %x xid %u %s:%d done? %d ret %d \n",
-            clt_nonce_, proc, ca.xid, inet_ntoa(dst_.sin_addr),
-            ntohs(dst_.sin_port), ca.done, ca.intret);
+            clt_nonce_, proc, xid, inet_ntoa(dst_.sin_addr),
+            ntohs(dst_.sin_port), done, intret);
 
     if (ch)
         ch->decref();
     //destruction of req automatically frees its buffer
-    return (ca.done ? ca.intret : rpc_const::timeout_failure);
+    return (done ? intret : failure);
+}
+
+void rpcc::async_call1(unsigned int proc, marshall &req, callback_t cb,
+                       TO to) {
+    caller *ca = new caller();
+    ca->cb = cb;
+
+    // like every completion, a call that fails before it is sent
+    // completes on the TimerMgr, not on this thread, which may hold
+    // locks cb takes
+    auto fail = [ca](int intret) {
+        TimerMgr::Instance()->schedule(0, [ca, intret]() {
+            ca->intret = intret;
+            ca->cb(ca->intret, ca->reply);
+            delete ca;
+        });
+    };
+
+    if (proc == rpc_const::bind && bind_done_) {
+        jsl_log(JSL_DBG_1, "rpcc::async_call1 rpcc binding twice\n");
+        fail(rpc_const::bind_failure);
+        return;
+    }
+
+    if (!breaker_admit()) {
+        fail(rpc_const::unavailable_failure);
+        return;
+    }
+
+    ca->refs = 2; // the slot and this thread
+    ca->connects = connects_.load();
+    slot_t *sl;
+    ca->xid = claim_slot(&sl, ca, NULL);
+
+    unsigned int srv_nonce = srv_nonce_.load();
+    ca->unbound = !srv_nonce && proc != rpc_const::bind;
+    req_header h(ca->xid, proc, clt_nonce_, srv_nonce, xid_rep());
+    req.pack_req_header(h);
+    req.take_buf(&ca->req, &ca->reqsz);
+    // the request outlives this call, for retransmissions
+    ca->req->own_borrowed();
+
+    ca->deadline = now_ms() + to.to;
+    int rto0 = rto();
+    ca->curr_to = rto0 < to.to ? rto0 : to.to;
+    {
+        ScopedLock ml(&m_);
+        unsigned int xid = ca->xid;
+        ca->timer = TimerMgr::Instance()->schedule(ca->curr_to,
+                [this, xid]() { async_timeout(xid); });
+    }
+
+    async_transmit(ca);
+    jsl_log(JSL_DBG_2,
+            "rpcc::async_call1 %u just sent req proc %x xid %u\n",
+            clt_nonce_, proc, ca->xid);
+    put_caller(ca);
+}
+
+// drops a reference to an asynchronous caller, freeing it with the last one
+void rpcc::put_caller(caller *ca) {
+    {
+        ScopedLock ml(&m_);
+        if (--ca->refs > 0)
+            return;
+    }
+    if (ca->ch)
+        ca->ch->decref();
+    if (ca->req)
+        ca->req->decref();
+    delete ca;
 }
 
+bool rpcc::unbound_resend(unsigned long long sent, unsigned long long serial,
+                          unsigned int *stamp) {
+    *stamp = 0;
+    // a connection reaches one server instance, which knows the copy
+    if (sent && sent == serial)
+        return true;
+    // another connection may reach another instance, which would run
+    // the request again, unless the request names the instance the
+    // copy went to
+    if (bind_done_ && (!sent || sent == bound_on_.load())) {
+        *stamp = srv_nonce_.load();
+        return true;
+    }
+    return !sent;
+}
+
+// (re)sends an asynchronous call; the caller must hold a reference to ca
+void rpcc::async_transmit(caller *ca) {
+    connection *ch = NULL;
+    get_refconn(&ch);
+
+    bool unbound = false;
+    bool skip = false;
+    bool failed = false;
+    if (ch) {
+        ScopedLock ml(&m_);
+        // the timer and resume_calls may both resend ca; once on ch is
+        // enough.  an unbound copy is sent by one thread at a time, so
+        // that unbound_on accounts for every copy
+        if (ca->ch == ch || (ca->unbound && ca->transmitting)) {
+            skip = true;
+        } else if (ca->unbound) {
+            unsigned int stamp;
+            if (!unbound_resend(ca->unbound_on, ch->serial(), &stamp)) {
+                failed = true;
+            } else if (stamp) {
+                restamp_req_header(ca->req, stamp);
+                ca->unbound = false;
+            } else {
+                unbound = ca->transmitting = true;
+            }
+        }
+    }
+    if (skip || failed) {
+        ch->decref();
+        if (failed)
+            fail_async(ca, rpc_const::oldsrv_failure);
+        return;
+    }
+
+    long long now = now_us();
+    bool sent = ch && ch->send(ca->req, ca->reqsz);
+
+    ScopedLock ml(&m_);
+    if (ch && !ca->sends++)
+        ca->sent_us = now;
+    if (unbound) {
+        ca->transmitting = false;
+        if (sent)
+            ca->unbound_on = ch->serial();
+    }
+    std::swap(ca->ch, ch);
+    if (ch)
+        ch->decref();
+}
+
+// completes a pending asynchronous call with intret, unless it completed
+// already; the caller must hold a reference to ca
+void rpcc::fail_async(caller *ca, int intret) {
+    {
+        ScopedLock ml(&m_);
+        slot_t *sl = find_slot(ca->xid);
+        uint64_t t = slot_tag(ca->xid, SLOT_WAITING);
+        if (!sl->tag.compare_exchange_strong(t, slot_tag(ca->xid, SLOT_CLAIMED)))
+            return;
+        release_slot(sl);
+        if (!TimerMgr::Instance()->cancel(ca->timer, false))
+            zombie_timers_[ca->xid] = ca->timer;
+    }
+    {
+        ScopedLock xl(&xid_rep_m_);
+        update_xid_rep(ca->xid);
+    }
+    ca->intret = intret;
+    ca->cb(ca->intret, ca->reply);
+    put_caller(ca);
+}
+
+// TimerMgr callback of a pending asynchronous call: retransmits on a new
+// connection if the old one died, and fails the call at its deadline
+void rpcc::async_timeout(unsigned int xid) {
+    caller *ca;
+    connection *ch = NULL;
+    bool timedout = false;
+    {
+        ScopedLock ml(&m_);
+        // got_pdu claims asynchronous calls under m_ as well, so the
+        // slot can't change under us
+        slot_t *sl = find_slot(xid);
+        uint64_t t = slot_tag(xid, SLOT_WAITING);
+        if (!sl || sl->tag.load() != t) {
+            zombie_timers_.erase(xid);
+            return;
+        }
+        ca = sl->ca.load();
+
+        if (now_ms() >= ca->deadline) {
+            assert(sl->tag.compare_exchange_strong(t, slot_tag(xid, SLOT_CLAIMED)));
+            release_slot(sl);
+            {
+                ScopedLock xl(&xid_rep_m_);
+                update_xid_rep(xid);
+            }
+            ca->intret = rpc_const::timeout_failure;
+            timedout = true;
+        } else {
+            // isdead() takes the connection's lock, which got_pdu holds
+            // while it waits for m_, so look at the connection after
+            if ((ch = ca->ch))
+                ch->incref();
+            ca->refs++;
+        }
+    }
+
+    if (timedout) {
+        jsl_log(JSL_DBG_2, "rpcc::async_timeout %u xid %u timed out\n",
+                clt_nonce_, xid);
+        breaker_result(false);
+        ca->cb(ca->intret, ca->reply);
+        put_caller(ca);
+        return;
+    }
+
+    bool resend = !ch || (retrans_ && ch->isdead());
+    if (ch)
+        ch->decref();
+    if (resend && breaker_open()) {
+        // dst failed since the call was issued: give up rather than
+        // wait for a connection
+        bool failed;
+        {
+            ScopedLock ml(&m_);
+            slot_t *sl = find_slot(xid);
+            uint64_t t = slot_tag(xid, SLOT_WAITING);
+            failed = sl->tag.compare_exchange_strong(t, slot_tag(xid, SLOT_CLAIMED));
+            if (failed)
+                release_slot(sl);
+            else
+                zombie_timers_.erase(xid);
+        }
+        if (failed) {
+            {
+                ScopedLock xl(&xid_rep_m_);
+                update_xid_rep(xid);
+            }
+            ca->intret = rpc_const::unavailable_failure;
+            ca->cb(ca->intret, ca->reply);
+            put_caller(ca);
+        }
+        put_caller(ca);
+        return;
+    }
+    if (resend)
+        async_transmit(ca);
+
+    {
+        ScopedLock ml(&m_);
+        slot_t *sl = find_slot(xid);
+        if (sl->tag.load() != slot_tag(xid, SLOT_WAITING)) {
+            // completed while we were retransmitting
+            zombie_timers_.erase(xid);
+        } else {
+            long long left = ca->deadline - now_ms();
+            ca->curr_to <<= 1;
+            ca->timer = TimerMgr::Instance()->schedule(
+                    ca->curr_to < left ? ca->curr_to : (left > 0 ? left : 0),
+                    [this, xid]() { async_timeout(xid); });
+        }
+    }
+    put_caller(ca);
+}
+
+// hands out a reference to the current channel, or sets *ch to NULL and
+// starts connecting if there is none.  never blocks on the network
 void rpcc::get_refconn(connection **ch) {
     ScopedLock ml(&chan_m_);
-    if (!chan_ || chan_->isdead()) {
-        if (chan_)
-            chan_->decref();
-        chan_ = connect_to_dst(dst_, this, lossytest_);
+    if (chan_ && chan_->isdead()) {
+        chan_->decref();
+        chan_ = NULL;
     }
-    if (ch && chan_) {
+    if (!chan_)
+        start_connect();
+    if (ch) {
         if (*ch) {
             (*ch)->decref();
         }
         *ch = chan_;
-        (*ch)->incref();
+        if (*ch)
+            (*ch)->incref();
+    }
+}
+
+// assumes thread holds chan_m_
+void rpcc::start_connect() {
+    if (connecting_ || chan_closing_)
+        return;
+    long long wait = next_connect_ms_ - now_ms();
+    if (wait > 0) {
+        if (!connect_timer_) {
+            connect_timer_ = TimerMgr::Instance()->schedule(wait,
+                    [this]() { retry_connect(); });
+        }
+        return;
+    }
+    connecting_ = true;
+    connects_++;
+    connect_async(dst_, this, lossytest_, CONNECT_TIMEOUT_MS,
+                  [this](connection *c) { connected(c); });
+}
+
+void rpcc::retry_connect() {
+    ScopedLock ml(&chan_m_);
+    connect_timer_ = 0;
+    if (!chan_ || chan_->isdead())
+        start_connect();
+}
+
+void rpcc::connected(connection *c) {
+    {
+        ScopedLock ml(&chan_m_);
+        if (c) {
+            if (chan_)
+                chan_->decref();
+            chan_ = c;
+            connect_fails_ = 0;
+            next_connect_ms_ = 0;
+            if (connected_once_)
+                failovers_++;
+            connected_once_ = true;
+        } else {
+            // back off for a random time in [d/2, d], so that clients
+            // that lost dst together do not all come back at once
+            int d = BACKOFF_MAX_MS;
+            if (connect_fails_ < 16 && (BACKOFF_MIN_MS << connect_fails_) < d)
+                d = BACKOFF_MIN_MS << connect_fails_;
+            connect_fails_++;
+            next_connect_ms_ = now_ms() + d / 2 + random() % (d / 2 + 1);
+            failed_connect_.store(connects_.load());
+        }
+    }
+
+    if (c) {
+        c->incref();
+        resume_calls(c);
+        c->decref();
+    } else {
+        jsl_log(JSL_DBG_1, "rpcc::connected %u cannot reach %s:%d\n",
+                clt_nonce_, inet_ntoa(dst_.sin_addr), ntohs(dst_.sin_port));
+        breaker_result(false);
+        fail_unsent();
+    }
+
+    ScopedLock ml(&chan_m_);
+    connecting_ = false;
+    assert(pthread_cond_broadcast(&connect_c_) == 0);
+}
+
+void rpcc::dead_conn(connection *c) {
+    if (!retrans_)
+        return;
+    ScopedLock ml(&m_);
+    if (closing_ || failover_pending_)
+        return;
+    failover_pending_ = true;
+    failover_timer_ = TimerMgr::Instance()->schedule(0, [this]() { failover(); });
+}
+
+void rpcc::failover() {
+    {
+        ScopedLock ml(&m_);
+        failover_pending_ = false;
+    }
+    // usually this starts a connect, and connected resumes the calls
+    connection *ch = NULL;
+    get_refconn(&ch);
+    if (!ch)
+        return;
+    resume_calls(ch);
+    ch->decref();
+}
+
+void rpcc::resume_calls(connection *ch) {
+    // asynchronous calls are resent from here.  synchronous callers own
+    // their requests, so they are woken to see the dead channel and
+    // resend on ch themselves
+    std::vector<caller *> resend;
+    {
+        ScopedLock ml(&m_);
+        walk_waiting([&](slot_t *sl, caller *ca) {
+            if (!ca) {
+                kick_slot(sl);
+            } else if (ca->ch != ch) {
+                ca->refs++;
+                resend.push_back(ca);
+            }
+        });
+    }
+    jsl_log(JSL_DBG_2, "rpcc::resume_calls %u resending %d calls\n",
+            clt_nonce_, (int) resend.size());
+    for (unsigned int i = 0; i < resend.size(); i++) {
+        async_transmit(resend[i]);
+        put_caller(resend[i]);
     }
 }
 
-//PollMgr's thread is being used to 
+void rpcc::fail_unsent() {
+    std::vector<caller *> failed;
+    {
+        ScopedLock ml(&m_);
+        unsigned int last = failed_connect_.load();
+        walk_waiting([&](slot_t *sl, caller *ca) {
+            if (!ca) {
+                // the caller decides for itself, as it knows whether
+                // it sent its request
+                kick_slot(sl);
+                return;
+            }
+            // async_call1 has yet to arm the timer of a call it is
+            // still issuing
+            if (!ca->timer || ca->sends || last <= ca->connects)
+                return;
+            uint64_t t = slot_tag(ca->xid, SLOT_WAITING);
+            if (!sl->tag.compare_exchange_strong(t,
+                    slot_tag(ca->xid, SLOT_CLAIMED)))
+                return;
+            release_slot(sl);
+            if (!TimerMgr::Instance()->cancel(ca->timer, false))
+                zombie_timers_[ca->xid] = ca->timer;
+            failed.push_back(ca);
+        });
+    }
+    for (unsigned int i = 0; i < failed.size(); i++) {
+        caller *ca = failed[i];
+        {
+            ScopedLock xl(&xid_rep_m_);
+            update_xid_rep(ca->xid);
+        }
+        ca->intret = rpc_const::conn_failure;
+        ca->cb(ca->intret, ca->reply);
+        put_caller(ca);
+    }
+}
+
+// assumes thread holds m_
+void rpcc::walk_waiting(const std::function<void(slot_t *, caller *)> &f) {
+    for (unsigned int i = 0; i < CALL_SLOTS / CALL_SEG; i++) {
+        slot_t *seg = slots_[i].load();
+        if (!seg)
+            continue;
+        for (unsigned int j = 0; j < CALL_SEG; j++) {
+            slot_t *sl = &seg[j];
+            if ((sl->tag.load() & 0xffffffff) == SLOT_WAITING)
+                f(sl, sl->ca.load());
+        }
+    }
+}
+
+bool rpcc::breaker_admit() {
+    if (breaker_.load() == BREAKER_CLOSED)
+        return true;
+    ScopedLock bl(&breaker_m_);
+    if (breaker_.load() == BREAKER_CLOSED)
+        return true;
+    long long now = now_ms();
+    if (now < breaker_probe_ms_)
+        return false;
+    // this call is the probe; the next may go if it takes too long
+    breaker_.store(BREAKER_HALF_OPEN);
+    breaker_probe_ms_ = now + BREAKER_OPEN_MS;
+    return true;
+}
+
+void rpcc::breaker_result(bool ok) {
+    if (ok && !breaker_fails_.load() && breaker_.load() == BREAKER_CLOSED)
+        return;
+    {
+        ScopedLock bl(&breaker_m_);
+        if (ok) {
+            if (breaker_.load() != BREAKER_CLOSED) {
+                jsl_log(JSL_DBG_1, "rpcc::breaker_result %u %s:%d is back\n",
+                        clt_nonce_, inet_ntoa(dst_.sin_addr),
+                        ntohs(dst_.sin_port));
+            }
+            breaker_fails_.store(0);
+            breaker_.store(BREAKER_CLOSED);
+            return;
+        }
+        int fails = ++breaker_fails_;
+        int state = breaker_.load();
+        if (state == BREAKER_OPEN ||
+            (state == BREAKER_CLOSED && fails < BREAKER_FAILURES))
+            return;
+        breaker_.store(BREAKER_OPEN);
+        breaker_probe_ms_ = now_ms() + BREAKER_OPEN_MS;
+        breaker_trips_++;
+    }
+    jsl_log(JSL_DBG_1, "rpcc::breaker_result %u %s:%d is failing\n",
+            clt_nonce_, inet_ntoa(dst_.sin_addr), ntohs(dst_.sin_port));
+
+    // synchronous callers waiting for a connection see the breaker
+    // open and give up; asynchronous calls do at their next timeout
+    ScopedLock ml(&m_);
+    walk_waiting([](slot_t *sl, caller *ca) {
+        if (!ca)
+            kick_slot(sl);
+    });
+}
+
+//the connection's PollMgr thread is being used to 
 //make this upcall from connection object to 
 //rpcc. 
 //this funtion must not block 
 //
 //this function keeps no reference for connection *c 
-bool rpcc::got_pdu(connection *c, char *b, int sz) {
-    unmarshall rep(b, sz);
+bool rpcc::got_pdu(connection *c, rpcbuf *b, char *pdu, int sz) {
+    unmarshall rep(b, pdu, sz);
     reply_header h;
     rep.unpack_reply_header(&h);
 
@@ -274,60 +1002,141 @@ bool rpcc::got_pdu(connection *c, char *b, int sz) {
         return true;
     }
 
-    ScopedLock ml(&m_);
+    {
+        ScopedLock xl(&xid_rep_m_);
+        update_xid_rep(h.xid);
+    }
 
-    update_xid_rep(h.xid);
+    // the first reply binds the client to the server instance that sent
+    // it, sparing the round trip of a separate bind
+    if (!bind_done_ && h.srv_nonce) {
+        unsigned int unbound = 0;
+        if (srv_nonce_.compare_exchange_strong(unbound, h.srv_nonce)) {
+            bound_on_ = c->serial();
+            bind_done_ = true;
+        }
+    }
 
-    if (calls_.find(h.xid) == calls_.end()) {
+    slot_t *sl = find_slot(h.xid);
+    uint64_t waiting = slot_tag(h.xid, SLOT_WAITING);
+    if (!sl || sl->tag.load() != waiting) {
         jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
         return true;
     }
-    caller *ca = calls_[h.xid];
 
-    ScopedLock cl(&ca->m);
-    if (!ca->done) {
-        ca->un->take_in(rep);
-        ca->intret = h.ret;
-        if (ca->intret < 0) {
+    if (!sl->ca.load()) {
+        // a synchronous call: claim it, fill in the reply and wake the
+        // caller, who may have given up meanwhile
+        uint64_t t = waiting;
+        if (!sl->tag.compare_exchange_strong(t, slot_tag(h.xid, SLOT_CLAIMED)))
+            return true;
+        sl->un->take_in(rep);
+        sl->intret = h.ret;
+        if (h.ret < 0) {
             jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
-                    h.xid, ca->intret);
+                    h.xid, h.ret);
         }
-        ca->done = 1;
+        done_slot(sl, h.xid);
+        return true;
     }
-    assert(pthread_cond_broadcast(&ca->c) == 0);
+
+    caller *ca;
+    bool sample;
+    {
+        ScopedLock ml(&m_);
+        uint64_t t = waiting;
+        if (!sl->tag.compare_exchange_strong(t, slot_tag(h.xid, SLOT_CLAIMED)))
+            return true;
+        ca = sl->ca.load();
+        release_slot(sl);
+        if (!TimerMgr::Instance()->cancel(ca->timer, false))
+            zombie_timers_[h.xid] = ca->timer;
+        sample = ca->sends == 1;
+    }
+    if (sample)
+        rtt_sample(now_us() - ca->sent_us);
+    breaker_result(true);
+    ca->reply.take_in(rep);
+    ca->intret = h.ret;
+    // c is locked; the callback may well start another call on it
+    connection::defer([this, ca]() {
+        ca->cb(ca->intret, ca->reply);
+        put_caller(ca);
+    });
     return true;
 }
 
-// assumes thread holds mutex m
-void rpcc::update_xid_rep(unsigned int xid) {
-    std::list<unsigned int>::iterator it;
+void rpcc::rtt_sample(long long us) {
+    if (us > to_max.to * 1000LL)
+        us = to_max.to * 1000LL;
+    int r = (int) us;
+    int srtt = srtt_us_.load();
+    if (!srtt) {
+        srtt_us_.store(r > 0 ? r : 1);
+        rttvar_us_.store(r / 2);
+        return;
+    }
+    int err = r - srtt;
+    srtt = srtt + err / 8;
+    srtt_us_.store(srtt > 0 ? srtt : 1);
+    int var = rttvar_us_.load();
+    rttvar_us_.store(var + ((err < 0 ? -err : err) - var) / 4);
+}
 
-    if (xid <= xid_rep_window_.front()) {
+int rpcc::rto() {
+    int srtt = srtt_us_.load();
+    if (!srtt)
+        return to_min.to;
+    int ms = (srtt + 4 * rttvar_us_.load() + 999) / 1000;
+    if (ms < RTO_MIN_MS)
+        return RTO_MIN_MS;
+    return ms < to_min.to ? ms : to_min.to;
+}
+
+// assumes thread holds xid_rep_m_
+void rpcc::update_xid_rep(unsigned int xid) {
+    if (xid <= xid_rep_) {
         return;
     }
 
-    for (it = xid_rep_window_.begin(); it != xid_rep_window_.end(); it++) {
-        if (*it > xid) {
-            xid_rep_window_.insert(it, xid);
-            goto compress;
-        }
+    // out of the window: the oldest xids drop out of it
+    while (xid - xid_rep_ >= XID_REP_BITS) {
+        xid_rep_++;
+        unsigned int i = xid_rep_ % XID_REP_BITS;
+        xid_rep_bits_[i / 64] &= ~(1ULL << (i % 64));
     }
-    xid_rep_window_.push_back(xid);
 
-    compress:
-    it = xid_rep_window_.begin();
-    for (it++; it != xid_rep_window_.end(); it++) {
-        while (xid_rep_window_.front() + 1 == *it)
-            xid_rep_window_.pop_front();
+    unsigned int i = xid % XID_REP_BITS;
+    xid_rep_bits_[i / 64] |= 1ULL << (i % 64);
+
+    // move past the run of replied xids that follows xid_rep_, a word
+    // at a time
+    for (;;) {
+        i = (xid_rep_ + 1) % XID_REP_BITS;
+        uint64_t w = xid_rep_bits_[i / 64] >> (i % 64);
+        if (!(w & 1))
+            break;
+        int n = ~w ? __builtin_ctzll(~w) : 64;
+        uint64_t run = n == 64 ? ~0ULL : (1ULL << n) - 1;
+        xid_rep_bits_[i / 64] &= ~(run << (i % 64));
+        xid_rep_ += n;
     }
 }
 
 
 rpcs::rpcs(unsigned int p1, int count)
-        : port_(p1), counting_(count), curr_counts_(count), lossytest_(0) {
+        : port_(p1), reply_client_budget_(REPLY_CLIENT_BYTES),
+          reply_budget_(REPLY_TOTAL_BYTES), reply_bytes_(0), reply_count_(0),
+          reply_evicted_(0), reply_forgotten_(0), req_seq_(0),
+          session_ttl_ms_(SESSION_TTL_MS), sessions_reaped_(0),
+          conns_released_(0), reap_timer_(0), reap_stopped_(false),
+          counting_(count), curr_counts_(count), lossytest_(0) {
     assert(pthread_mutex_init(&procs_m_, 0) == 0);
     assert(pthread_mutex_init(&count_m_, 0) == 0);
-    assert(pthread_mutex_init(&reply_window_m_, 0) == 0);
+    for (unsigned int i = 0; i < REPLY_SHARDS; i++)
+        assert(pthread_mutex_init(&reply_shards_[i].m, 0) == 0);
+    assert(pthread_mutex_init(&evict_m_, 0) == 0);
+    assert(pthread_mutex_init(&reap_m_, 0) == 0);
     assert(pthread_mutex_init(&conss_m_, 0) == 0);
 
     set_rand_seed();
@@ -339,26 +1148,61 @@ rpcs::rpcs(unsigned int p1, int count)
         lossytest_ = atoi(loss_env);
     }
 
+    char *ttl_env = getenv("RPC_SESSION_TTL");
+    if (ttl_env != NULL) {
+        session_ttl_ms_ = atoi(ttl_env);
+    }
+
     reg(rpc_const::bind, this, &rpcs::rpcbind);
     dispatchpool_ = new ThrPool(10, false);
 
     listener_ = new tcpsconn(this, port_, lossytest_);
+
+    ScopedLock rl(&reap_m_);
+    schedule_reap();
 }
 
 rpcs::~rpcs() {
+    TimerMgr::timer_id t;
+    {
+        ScopedLock rl(&reap_m_);
+        reap_stopped_ = true;
+        t = reap_timer_;
+    }
+    TimerMgr::Instance()->cancel(t);
+
     //must delete listener before dispatchpool
     delete listener_;
     delete dispatchpool_;
     free_reply_window();
+
+    std::map<unsigned int, connection *>::iterator ci;
+    for (ci = conns_.begin(); ci != conns_.end(); ci++)
+        ci->second->decref();
+    conns_.clear();
 }
 
-bool rpcs::got_pdu(connection *c, char *b, int sz) {
-    djob_t *j = new djob_t(c, b, sz);
+bool rpcs::got_pdu(connection *c, rpcbuf *b, char *pdu, int sz) {
+    // a slice of the connection's receive buffer would keep all of it
+    // alive while the request waits for and runs its handler, and for
+    // as long as an rpcstr taken from the request lives on.  a request
+    // filling less than half its buffer is copied into one of its own
+    rpcbuf *own = NULL;
+    if (sz < b->capa() / 2) {
+        own = rpcbuf::alloc(sz);
+        memcpy(own->data(), pdu, sz);
+    }
+    djob_t *j = own ? new djob_t(c, own, own->data(), sz)
+                    : new djob_t(c, b, pdu, sz);
     c->incref();
     bool succ = dispatchpool_->addObjJob(this, &rpcs::dispatch, j);
     if (!succ) {
         c->decref();
         delete j;
+        if (own)
+            own->decref();
+    } else if (own) {
+        b->decref();
     }
     return succ;
 }
@@ -379,24 +1223,26 @@ void rpcs::updatestat(unsigned int proc) {
         for (i = counts_.begin(); i != counts_.end(); i++) {
             jsl_log(JSL_DBG_1, "RPC STATS: %x %d\n", i->first, i->second);
         }
-        ScopedLock rwl(&reply_window_m_);
-        std::map<unsigned int, std::list<reply_t> >::iterator clt;
-
-        unsigned int totalrep = 0, maxrep = 0;
-        for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++) {
-            totalrep += clt->second.size();
-            if (clt->second.size() > maxrep)
-                maxrep = clt->second.size();
+        unsigned int nclients = 0, totalrep = 0, maxrep = 0;
+        for (unsigned int i = 0; i < REPLY_SHARDS; i++) {
+            ScopedLock rwl(&reply_shards_[i].m);
+            for (auto &clt : reply_shards_[i].clients) {
+                unsigned int n = clt.second.replies.size();
+                nclients++;
+                totalrep += n;
+                if (n > maxrep)
+                    maxrep = n;
+            }
         }
-        jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %ld total reply %d max per client %d\n",
-                reply_window_.size(), totalrep, maxrep);
+        jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %u total reply %d max per client %d\n",
+                nclients, totalrep, maxrep);
         curr_counts_ = counting_;
     }
 }
 
 void rpcs::dispatch(djob_t *j) {
     connection *c = j->conn;
-    unmarshall req(j->buf, j->sz);
+    unmarshall req(j->buf, j->pdu, j->sz);
     delete j;
 
     req_header h;
@@ -414,7 +1260,7 @@ void rpcs::dispatch(djob_t *j) {
             h.xid, proc, h.xid_rep, h.clt_nonce, h.srv_nonce);
 
     marshall rep;
-    reply_header rh(h.xid, 0);
+    reply_header rh(h.xid, 0, nonce_);
 
     //is client sending to an old instance of server?
     if (h.srv_nonce != 0 && h.srv_nonce != nonce_) {
@@ -423,7 +1269,7 @@ void rpcs::dispatch(djob_t *j) {
                 h.srv_nonce, nonce_, h.proc);
         rh.ret = rpc_const::oldsrv_failure;
         rep.pack_reply_header(rh);
-        c->send(rep.cstr(), rep.size());
+        c->send(rep.buf(), rep.size());
         return;
     }
 
@@ -442,22 +1288,10 @@ void rpcs::dispatch(djob_t *j) {
     }
 
     rpcs::rpcstate_t stat;
-    char *b1;
+    rpcbuf *b1;
     int sz1;
 
     if (h.clt_nonce) {
-        //have i seen this client before?
-        {
-            ScopedLock rwl(&reply_window_m_);
-            // if we don't know about this clt_nonce, create a cleanup object
-            if (reply_window_.find(h.clt_nonce) == reply_window_.end()) {
-                assert (reply_window_[h.clt_nonce].size() == 0); // create
-                jsl_log(JSL_DBG_2,
-                        "rpcs::dispatch: new client %u xid %d chan %d, total clients %d\n",
-                        h.clt_nonce, h.xid, c->channo(), (int) reply_window_.size());
-            }
-        }
-
         // save the latest good connection to the client
         {
             ScopedLock rwl(&conss_m_);
@@ -496,206 +1330,415 @@ void rpcs::dispatch(djob_t *j) {
 
             if (h.clt_nonce > 0) {
                 //only record replies for clients that require at-most-once logic
+                b1->incref();
                 add_reply(h.clt_nonce, h.xid, b1, sz1);
             }
 
             // get the latest connection to the client
-            {
+            if (c->isdead()) {
                 ScopedLock rwl(&conss_m_);
-                if (c->isdead() && c != conns_[h.clt_nonce]) {
+                auto ci = conns_.find(h.clt_nonce);
+                if (ci != conns_.end() && ci->second != c) {
                     c->decref();
-                    c = conns_[h.clt_nonce];
+                    c = ci->second;
                     c->incref();
                 }
             }
 
             c->send(b1, sz1);
-            if (h.clt_nonce == 0) {
-                //reply is not added to at-most-once window, free it
-                free(b1);
-            }
+            b1->decref();
             break;
         case INPROGRESS: //server is working on this request
             break;
         case DONE: //duplicate and we still have the response
             c->send(b1, sz1);
+            b1->decref();
             break;
         case FORGOTTEN: //very old request and we don't have the response anymore
             jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n",
                     h.xid, h.clt_nonce);
+            reply_forgotten_++;
             rh.ret = rpc_const::atmostonce_failure;
             rep.pack_reply_header(rh);
-            c->send(rep.cstr(), rep.size());
+            c->send(rep.buf(), rep.size());
             break;
     }
     c->decref();
 }
 
-// assumes thread holds mutex m
-auto rpcs::search_reply(unsigned int client_id, unsigned int req_id) {
-    std::list<reply_t> &l = reply_window_.at(client_id);
-    return std::find_if(l.begin(), l.end(), [req_id](reply_t &reply) { return reply.xid == req_id; });
-}
-
 void rpcs::add_reply(unsigned int clt_nonce, unsigned int xid,
-                     char *b, int sz) {
-    ScopedLock rwl(&reply_window_m_);
+                     rpcbuf *b, int sz) {
+    bool over;
+    {
+        reply_shard_t &sh = reply_shard(clt_nonce);
+        ScopedLock rwl(&sh.m);
+
+        // the session can't expire while we work on xid, but the client
+        // may have given up on xid, and acknowledged it, meanwhile
+        auto cit = sh.clients.find(clt_nonce);
+        assert(cit != sh.clients.end());
+        client_t &clt = cit->second;
+        assert(clt.running > 0);
+        clt.running--;
+        if (xid < clt.base || xid - clt.base >= clt.replies.size()) {
+            b->decref();
+            return;
+        }
+        reply_t &reply = clt.replies[xid - clt.base];
+        assert(reply.seen && !reply.cb_present);
+        reply.cb_present = true;
+        reply.buf = b;
+        reply.sz = sz;
+
+        // a segment referring to a received buffer keeps all of it
+        size_t cost = b->footprint();
+        clt.bytes += cost;
+        if (xid < clt.evict_xid)
+            clt.evict_xid = xid;
+        reply_count_++;
+        over = (reply_bytes_ += cost) > (long long) reply_budget_;
+
+        while (clt.bytes > reply_client_budget_ && evict_oldest(clt))
+            ;
+    }
 
-    // search for current reply and assert it exists
-    auto it = this->search_reply(clt_nonce, xid);
-    assert(it != reply_window_.at(clt_nonce).end());
-    reply_t &reply = *it;
-    reply.cb_present = true;
-    reply.buf = b;
-    reply.sz = sz;
+    if (over)
+        evict_global();
 }
 
-void rpcs::free_reply_window(void) {
-    std::map<unsigned int, std::list<reply_t> >::iterator clt;
-    std::list<reply_t>::iterator it;
+void rpcs::drop_reply(client_t &clt, reply_t &reply, bool evict) {
+    size_t cost = reply.buf->footprint();
+    clt.bytes -= cost;
+    reply_bytes_ -= cost;
+    reply_count_--;
+    reply.buf->decref();
+    reply.buf = NULL;
+    if (evict) {
+        reply.cb_present = false;
+        reply.evicted = true;
+        reply_evicted_++;
+    }
+}
 
-    ScopedLock rwl(&reply_window_m_);
-    for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++) {
-        for (it = clt->second.begin(); it != clt->second.end(); it++) {
-            free((*it).buf);
+bool rpcs::evict_oldest(client_t &clt) {
+    if (clt.evict_xid < clt.base)
+        clt.evict_xid = clt.base;
+    for (; clt.evict_xid - clt.base < clt.replies.size(); clt.evict_xid++) {
+        reply_t &reply = clt.replies[clt.evict_xid - clt.base];
+        if (reply.buf) {
+            drop_reply(clt, reply, true);
+            clt.evict_xid++;
+            return true;
         }
-        clt->second.clear();
     }
-    reply_window_.clear();
+    return false;
 }
 
-rpcs::rpcstate_t rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
-                                                 unsigned int xid_rep, char **b, int *sz) {
-    ScopedLock rwl(&reply_window_m_);
+void rpcs::evict_global() {
+    // another thread already evicting will get us within budget
+    if (pthread_mutex_trylock(&evict_m_) != 0)
+        return;
 
-    if (xid < xid_rep)
-        return FORGOTTEN;
+    // evict down to 3/4 of the budget, so that we don't come back here
+    // for every reply while near it
+    long long target = reply_budget_ / 4 * 3;
+    while (reply_bytes_ > target) {
+        // the victim is the client we have heard from least recently
+        unsigned int victim = 0;
+        unsigned long long victim_seen = 0;
+        bool found = false;
+        for (unsigned int i = 0; i < REPLY_SHARDS; i++) {
+            ScopedLock rwl(&reply_shards_[i].m);
+            for (auto &clt : reply_shards_[i].clients) {
+                if (clt.second.bytes > 0 &&
+                    (!found || clt.second.seen < victim_seen)) {
+                    victim = clt.first;
+                    victim_seen = clt.second.seen;
+                    found = true;
+                }
+            }
+        }
+        if (!found)
+            break;
 
-    std::list<reply_t> &client_window = this->reply_window_.at(clt_nonce);
-    auto cw_start = std::find_if(client_window.begin(), client_window.end(),
-                                 [xid_rep](reply_t &reply) { return reply.xid == xid_rep; });
+        reply_shard_t &sh = reply_shard(victim);
+        ScopedLock rwl(&sh.m);
+        auto cit = sh.clients.find(victim);
+        if (cit == sh.clients.end())
+            continue;
+        jsl_log(JSL_DBG_2, "rpcs::evict_global: evicting replies of %u, "
+                "%lld bytes cached\n", victim, reply_bytes_.load());
+        while (reply_bytes_ > target && evict_oldest(cit->second))
+            ;
+    }
+    assert(pthread_mutex_unlock(&evict_m_) == 0);
+}
 
-    // update reply window
-    if (cw_start != client_window.end())
-        client_window.remove_if([xid_rep](reply_t &reply) { return reply.xid < xid_rep; });
+void rpcs::schedule_reap() {
+    if (reap_stopped_)
+        return;
+    // run a few times per TTL, so sessions expire soon after it
+    int interval = session_ttl_ms_ / 4;
+    if (interval < 10)
+        interval = 10;
+    else if (interval > 10000)
+        interval = 10000;
+    reap_timer_ = TimerMgr::Instance()->schedule(interval, [this]() { reap(); });
+}
 
-    auto it = this->search_reply(clt_nonce, xid);
-    if (it == client_window.end()) {
-        client_window.emplace_back(reply_t(xid));
-        return NEW;
-    } else {
-        reply_t &reply = *it;
-        if (reply.cb_present) {
-            *b = reply.buf;
-            *sz = reply.sz;
-            return DONE;
+void rpcs::reap() {
+    long long expiry = now_ms() - session_ttl_ms_;
+    std::vector<unsigned int> gone;
+    for (unsigned int i = 0; i < REPLY_SHARDS; i++) {
+        ScopedLock rwl(&reply_shards_[i].m);
+        auto &clients = reply_shards_[i].clients;
+        for (auto cit = clients.begin(); cit != clients.end();) {
+            if (cit->second.last_ms > expiry || cit->second.running > 0) {
+                cit++;
+                continue;
+            }
+            for (auto &reply : cit->second.replies) {
+                if (reply.buf)
+                    drop_reply(cit->second, reply, false);
+            }
+            gone.push_back(cit->first);
+            cit = clients.erase(cit);
         }
-        return INPROGRESS;
     }
-}
+    sessions_reaped_ += gone.size();
 
-//rpc handler
-int rpcs::rpcbind(int a, int &r) {
-    jsl_log(JSL_DBG_2, "rpcs::rpcbind called return nonce %u\n", nonce_);
-    r = nonce_;
-    return 0;
+    {
+        ScopedLock cl(&conss_m_);
+        for (unsigned int i = 0; i < gone.size(); i++) {
+            auto ci = conns_.find(gone[i]);
+            if (ci != conns_.end()) {
+                ci->second->decref();
+                conns_.erase(ci);
+                conns_released_++;
+            }
+        }
+        // a dead connection is of no use as a client's latest one
+        for (auto ci = conns_.begin(); ci != conns_.end();) {
+            if (ci->second->isdead()) {
+                ci->second->decref();
+                ci = conns_.erase(ci);
+                conns_released_++;
+            } else {
+                ci++;
+            }
+        }
+    }
+
+    if (gone.size() > 0)
+        jsl_log(JSL_DBG_2, "rpcs::reap: expired %d idle sessions\n",
+                (int) gone.size());
+
+    ScopedLock rl(&reap_m_);
+    schedule_reap();
 }
 
-void marshall::rawbyte(unsigned char x) {
-    if (_ind >= _capa) {
-        _capa *= 2;
-        assert (_buf != NULL);
-        _buf = (char *) realloc(_buf, _capa);
-        assert(_buf);
+rpcs::session_stats_t rpcs::session_stats() {
+    session_stats_t s;
+    s.sessions = 0;
+    for (unsigned int i = 0; i < REPLY_SHARDS; i++) {
+        ScopedLock rwl(&reply_shards_[i].m);
+        s.sessions += reply_shards_[i].clients.size();
     }
-    _buf[_ind++] = x;
+    {
+        ScopedLock cl(&conss_m_);
+        s.conns = conns_.size();
+    }
+    s.reaped = sessions_reaped_;
+    s.conns_released = conns_released_;
+    return s;
 }
 
-void marshall::rawbytes(const char *p, int n) {
-    if ((_ind + n) > _capa) {
-        _capa = _capa > n ? 2 * _capa : (_capa + n);
-        assert (_buf != NULL);
-        _buf = (char *) realloc(_buf, _capa);
-        assert(_buf);
+void rpcs::set_session_ttl(int ms) {
+    TimerMgr::timer_id t;
+    {
+        ScopedLock rl(&reap_m_);
+        session_ttl_ms_ = ms;
+        t = reap_timer_;
+    }
+    // restart the reaper at the new interval, unless it is running and
+    // about to reschedule itself
+    if (TimerMgr::Instance()->cancel(t, false)) {
+        ScopedLock rl(&reap_m_);
+        if (reap_timer_ == t)
+            schedule_reap();
     }
-    memcpy(_buf + _ind, p, n);
-    _ind += n;
 }
 
-marshall &operator<<(marshall &m, unsigned char x) {
-    m.rawbyte(x);
-    return m;
+rpcs::reply_stats_t rpcs::reply_stats() {
+    reply_stats_t s;
+    s.bytes = reply_bytes_;
+    s.replies = reply_count_;
+    s.evicted = reply_evicted_;
+    s.forgotten = reply_forgotten_;
+    return s;
 }
 
-marshall &operator<<(marshall &m, char x) {
-    m << (unsigned char) x;
-    return m;
+void rpcs::set_reply_budget(size_t per_client, size_t total) {
+    reply_client_budget_ = per_client;
+    reply_budget_ = total;
+}
+
+void rpcs::free_reply_window(void) {
+    for (unsigned int i = 0; i < REPLY_SHARDS; i++) {
+        ScopedLock rwl(&reply_shards_[i].m);
+        for (auto &clt : reply_shards_[i].clients) {
+            for (auto &reply : clt.second.replies) {
+                if (reply.buf)
+                    drop_reply(clt.second, reply, false);
+            }
+        }
+        reply_shards_[i].clients.clear();
+    }
 }
 
+rpcs::rpcstate_t rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
+                                                 unsigned int xid_rep, rpcbuf **b, int *sz) {
+    reply_shard_t &sh = reply_shard(clt_nonce);
+    ScopedLock rwl(&sh.m);
 
-marshall &operator<<(marshall &m, unsigned short x) {
-    m.rawbyte((x >> 8) & 0xff);
-    m.rawbyte(x & 0xff);
-    return m;
+    if (xid < xid_rep)
+        return FORGOTTEN;
+
+    auto cit = sh.clients.find(clt_nonce);
+    if (cit == sh.clients.end()) {
+        // the client has acknowledged everything below xid_rep
+        cit = sh.clients.emplace(clt_nonce, client_t()).first;
+        cit->second.base = xid_rep;
+        cit->second.bytes = 0;
+        cit->second.evict_xid = xid_rep;
+        cit->second.running = 0;
+        jsl_log(JSL_DBG_2,
+                "rpcs::checkduplicate_and_update: new client %u xid %d\n",
+                clt_nonce, xid);
+    }
+    client_t &clt = cit->second;
+    clt.seen = ++req_seq_;
+    clt.last_ms = now_ms();
+
+    // update reply window: forget the replies the client has acknowledged
+    while (clt.base < xid_rep && !clt.replies.empty()) {
+        if (clt.replies.front().buf)
+            drop_reply(clt, clt.replies.front(), false);
+        clt.replies.pop_front();
+        clt.base++;
+    }
+    if (clt.base < xid_rep)
+        clt.base = xid_rep;
+
+    if (xid < clt.base)
+        return FORGOTTEN;
+    // no client has this many calls outstanding; don't let a bogus xid
+    // make us allocate the slots up to it
+    if (xid - clt.base >= REPLY_WINDOW_MAX) {
+        jsl_log(JSL_DBG_1, "rpcs::checkduplicate_and_update: xid %u from %u "
+                "too far ahead of %u\n", xid, clt_nonce, clt.base);
+        return FORGOTTEN;
+    }
+    if (xid - clt.base >= clt.replies.size())
+        clt.replies.resize(xid - clt.base + 1);
+
+    reply_t &reply = clt.replies[xid - clt.base];
+    if (!reply.seen) {
+        reply.seen = true;
+        clt.running++;
+        return NEW;
+    }
+    if (reply.evicted)
+        return FORGOTTEN;
+    if (reply.cb_present) {
+        // the caller gets its own reference, as the window may drop its
+        // one before the duplicate reply is sent
+        reply.buf->incref();
+        *b = reply.buf;
+        *sz = reply.sz;
+        return DONE;
+    }
+    return INPROGRESS;
 }
 
-marshall &operator<<(marshall &m, short x) {
-    m << (unsigned short) x;
-    return m;
+//rpc handler
+int rpcs::rpcbind(int a, int &r) {
+    jsl_log(JSL_DBG_2, "rpcs::rpcbind called return nonce %u\n", nonce_);
+    r = nonce_;
+    return 0;
 }
 
-marshall &operator<<(marshall &m, unsigned int x) {
-    //network order is big-endian
-    m.rawbyte((x >> 24) & 0xff);
-    m.rawbyte((x >> 16) & 0xff);
-    m.rawbyte((x >> 8) & 0xff);
-    m.rawbyte(x & 0xff);
-    return m;
+void marshall::make_room(int n) {
+    int capa = _capa > n ? 2 * _capa : (_capa + n);
+    if (!_rb) {
+        spill(capa - _ind);
+        return;
+    }
+    _rb = _rb->grow(capa, _ind);
+    _buf = _rb->data();
+    _capa = _rb->capa();
 }
 
-marshall &operator<<(marshall &m, int x) {
-    m << (unsigned int) x;
-    return m;
+void marshall::spill(int n) {
+    assert(_rb == NULL && _buf == _inl);
+    _rb = rpcbuf::alloc(_ind + n);
+    memcpy(_rb->data(), _inl, _ind);
+    _buf = _rb->data();
+    _capa = _rb->capa();
 }
 
-marshall &operator<<(marshall &m, const std::string &s) {
-    m << (unsigned int) s.size();
-    m.rawbytes(s.data(), s.size());
-    return m;
+void marshall::rawbyte(unsigned char x) {
+    *reserve(1) = x;
+    _ind++;
 }
 
-marshall &operator<<(marshall &m, unsigned long long x) {
-    m << (unsigned int) (x >> 32);
-    m << (unsigned int) x;
-    return m;
+void marshall::rawbytes(const char *p, int n) {
+    memcpy(reserve(n), p, n);
+    _ind += n;
 }
 
-marshall &operator<<(marshall &m, unsigned long x) {
-    if (sizeof(unsigned long) == sizeof(unsigned int))
-        return m << (unsigned int) x;
-    if (sizeof(unsigned long) == sizeof(unsigned long long))
-        return m << (unsigned long long) x;
+marshall &operator<<(marshall &m, const std::string &s) {
+    m << (unsigned int) s.size();
+    if (s.size() >= (unsigned) RPC_SEG_MIN && m.borrowing())
+        m.rawseg(s.data(), s.size(), NULL, NULL);
+    else
+        m.rawbytes(s.data(), s.size());
+    return m;
 }
 
-void marshall::pack(int x) {
-    rawbyte((x >> 24) & 0xff);
-    rawbyte((x >> 16) & 0xff);
-    rawbyte((x >> 8) & 0xff);
-    rawbyte(x & 0xff);
+//a large string is moved into the PDU rather than copied
+marshall &operator<<(marshall &m, std::string &&s) {
+    m << (unsigned int) s.size();
+    if (s.size() >= (unsigned) RPC_SEG_MIN) {
+        std::string *own = new std::string(std::move(s));
+        m.rawseg(own->data(), own->size(), NULL, own);
+    } else {
+        m.rawbytes(s.data(), s.size());
+    }
+    return m;
 }
 
-void unmarshall::unpack(int *x) {
-    (*x) = (rawbyte() & 0xff) << 24;
-    (*x) |= (rawbyte() & 0xff) << 16;
-    (*x) |= (rawbyte() & 0xff) << 8;
-    (*x) |= rawbyte() & 0xff;
+marshall &operator<<(marshall &m, const rpcstr &s) {
+    m << (unsigned int) s.size();
+    if (s.size() >= (unsigned) RPC_SEG_MIN && s.buf()) {
+        s.buf()->incref();
+        m.rawseg(s.data(), s.size(), s.buf(), NULL);
+    } else {
+        m.rawbytes(s.data(), s.size());
+    }
+    return m;
 }
 
 //take the contents from another unmarshall object
 void unmarshall::take_in(unmarshall &another) {
-    if (_buf)
-        free(_buf);
-    another.take_buf(&_buf, &_sz);
+    if (_rb)
+        _rb->decref();
+    _rb = another._rb;
+    _buf = another._buf;
+    _sz = another._sz;
+    another._rb = NULL;
+    another._buf = NULL;
+    another._sz = another._ind = 0;
     _ind = RPC_HEADER_SZ;
     _ok = _sz >= RPC_HEADER_SZ ? true : false;
 }
@@ -717,61 +1760,15 @@ unsigned int unmarshall::rawbyte() {
     return c;
 }
 
-unmarshall &operator>>(unmarshall &u, unsigned char &x) {
-    x = (unsigned char) u.rawbyte();
-    return u;
-}
-
-unmarshall &operator>>(unmarshall &u, char &x) {
-    x = (char) u.rawbyte();
-    return u;
-}
-
-
-unmarshall &operator>>(unmarshall &u, unsigned short &x) {
-    x = (u.rawbyte() & 0xff) << 8;
-    x |= u.rawbyte() & 0xff;
-    return u;
-}
-
-unmarshall &operator>>(unmarshall &u, short &x) {
-    x = (u.rawbyte() & 0xff) << 8;
-    x |= u.rawbyte() & 0xff;
-    return u;
-}
-
-unmarshall &operator>>(unmarshall &u, unsigned int &x) {
-    x = (u.rawbyte() & 0xff) << 24;
-    x |= (u.rawbyte() & 0xff) << 16;
-    x |= (u.rawbyte() & 0xff) << 8;
-    x |= u.rawbyte() & 0xff;
-    return u;
-}
-
-unmarshall &operator>>(unmarshall &u, int &x) {
-    x = (u.rawbyte() & 0xff) << 24;
-    x |= (u.rawbyte() & 0xff) << 16;
-    x |= (u.rawbyte() & 0xff) << 8;
-    x |= u.rawbyte() & 0xff;
-    return u;
-}
-
-unmarshall &operator>>(unmarshall &u, unsigned long long &x) {
-    unsigned int h, l;
-    u >> h;
-    u >> l;
-    x = l | ((unsigned long long) h << 32);
+unmarshall &operator>>(unmarshall &u, std::string &s) {
+    unsigned sz;
+    u >> sz;
+    if (u.ok())
+        u.rawbytes(s, sz);
     return u;
 }
 
-unmarshall &operator>>(unmarshall &u, unsigned long &x) {
-    if (sizeof(unsigned long) == sizeof(unsigned int))
-        return u >> (unsigned int &) x;
-    if (sizeof(unsigned long) == sizeof(unsigned long long))
-        return u >> (unsigned long long &) x;
-}
-
-unmarshall &operator>>(unmarshall &u, std::string &s) {
+unmarshall &operator>>(unmarshall &u, rpcstr &s) {
     unsigned sz;
     u >> sz;
     if (u.ok())
@@ -790,6 +1787,16 @@ void unmarshall::rawbytes(std::string &ss, unsigned int n) {
     }
 }
 
+//points s at the next n bytes instead of copying them
+void unmarshall::rawbytes(rpcstr &s, unsigned int n) {
+    if ((_ind + n) > (unsigned) _sz) {
+        _ok = false;
+    } else {
+        s = rpcstr(_rb, _buf + _ind, n);
+        _ind += n;
+    }
+}
+
 bool operator<(const sockaddr_in &a, const sockaddr_in &b) {
     return ((a.sin_addr.s_addr < b.sin_addr.s_addr) ||
             ((a.sin_addr.s_addr == b.sin_addr.s_addr) &&
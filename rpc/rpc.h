@@ -3,14 +3,23 @@
 
 #include <sys/socket.h>
 #include <netinet/in.h>
-#include <list>
+#include <atomic>
+#include <deque>
 #include <map>
+#include <unordered_map>
+#include <functional>
+#include <future>
+#include <memory>
+#include <tuple>
+#include <type_traits>
+#include <utility>
 #include <sys/types.h>
 #include <unistd.h>
 
 #include "thr_pool.h"
 #include "marshall.h"
 #include "connection.h"
+#include "timermgr.h"
 
 #ifdef DMALLOC
 #include "dmalloc.h"
@@ -25,6 +34,8 @@ public:
     static const int atmostonce_failure = -4;
     static const int oldsrv_failure = -5;
     static const int bind_failure = -6;
+    static const int conn_failure = -7;   // dst refused or timed out the connect
+    static const int unavailable_failure = -8; // dst's circuit breaker is open
 };
 
 // rpc client endpoint.
@@ -32,42 +43,220 @@ public:
 // threaded: multiple threads can be sending RPCs,
 class rpcc : public chanmgr {
 
+public:
+    // completion callback of an asynchronous call, invoked exactly once
+    // with the call's return value and its reply (empty unless intret >= 0).
+    // runs on a PollMgr or TimerMgr thread and thus must not block, though
+    // it may start further calls
+    typedef std::function<void(int intret, unmarshall &rep)> callback_t;
+
 private:
 
-    //manages per rpc info
+    // an asynchronous call, for which the library rather than a waiting
+    // thread owns the request and drives retransmission
     struct caller {
-        caller(unsigned int xxid, unmarshall *un);
-
-        ~caller();
+        caller();
 
         unsigned int xid;
-        unmarshall *un;
         int intret;
-        bool done;
-        pthread_mutex_t m;
-        pthread_cond_t c;
+        unmarshall reply;
+        callback_t cb;
+        int refs; // protected by rpcc::m_
+        rpcbuf *req;
+        int reqsz;
+        connection *ch;
+        long long deadline; // CLOCK_MONOTONIC milliseconds
+        long long sent_us;  // first transmission, for the RTT estimate
+        int sends;          // protected by rpcc::m_
+        unsigned int connects; // rpcc::connects_ when issued
+        bool unbound;       // sent before the client was bound, not a bind
+        // the connection an unbound copy may have reached the server
+        // over, 0 if none; one thread at a time sends an unbound copy
+        unsigned long long unbound_on;
+        bool transmitting;  // protected by rpcc::m_
+        int curr_to;
+        TimerMgr::timer_id timer;
+    };
+
+    // a pending call's place in the slot table.  xid lives in slot
+    // xid % CALL_SLOTS.  slots are never freed while the rpcc lives, so
+    // got_pdu may look at one without a lock: whoever moves its tag from
+    // (xid, WAITING) to (xid, CLAIMED) completes the call
+    enum { SLOT_FREE = 0, SLOT_WAITING, SLOT_CLAIMED, SLOT_DONE };
+
+    struct slot_t {
+        std::atomic<uint64_t> tag;     // xid << 32 | state
+        std::atomic<int> seq;          // futex word, bumped on every wakeup
+        std::atomic<int> parked;       // 1 while the caller sleeps
+        std::atomic<unsigned int> kicks; // wakeups by the caller's timer
+        std::atomic<caller *> ca;      // asynchronous calls only
+        unmarshall *un;                // synchronous calls: the reply
+        int intret;
     };
 
+    static const unsigned int CALL_SEG = 64;     // slots per segment
+    static const unsigned int CALL_SLOTS = 4096; // calls outstanding at most
+
+    // segments are allocated on first use, so idle clients stay small
+    std::atomic<slot_t *> slots_[CALL_SLOTS / CALL_SEG];
+
+    static uint64_t slot_tag(unsigned int xid, int state) {
+        return ((uint64_t) xid << 32) | state;
+    }
+
+    // the slot of xid, or NULL if its segment was never used
+    slot_t *find_slot(unsigned int xid);
+
+    // takes a fresh xid and its slot, marked WAITING; waits while an
+    // older call still holds the slot
+    unsigned int claim_slot(slot_t **sl, caller *ca, unmarshall *un);
+
+    // frees a slot its owner is done with
+    void release_slot(slot_t *sl);
+
+    // waits until the call in sl is DONE, or for at most ms milliseconds
+    // if ms >= 0; returns whether it is done.  the TimerMgr wakes the
+    // caller when its time is up, so sleeping callers hold no kernel timer
+    bool wait_slot(slot_t *sl, unsigned int xid, int ms);
+
+    // completes the synchronous call in the CLAIMED slot sl
+    void done_slot(slot_t *sl, unsigned int xid);
+
+    // ends the current wait_slot of sl as if its time were up
+    static void kick_slot(slot_t *sl);
+
     void get_refconn(connection **ch);
 
     void update_xid_rep(unsigned int xid);
 
+    // the xid_rep to send with a request
+    unsigned int xid_rep();
+
+    // whether a request still unbound may go out over connection serial,
+    // if a copy of it may have reached the server over connection sent
+    // (0 if none has).  sets *stamp to the server instance the request
+    // is to name from now on, or to 0 if it must stay unbound
+    bool unbound_resend(unsigned long long sent, unsigned long long serial,
+                        unsigned int *stamp);
+
+    void async_transmit(caller *ca);
+
+    void fail_async(caller *ca, int intret);
+
+    void async_timeout(unsigned int xid);
+
+    void put_caller(caller *ca);
+
 
     sockaddr_in dst_;
     unsigned int clt_nonce_;
-    unsigned int srv_nonce_;
-    bool bind_done_;
-    unsigned int xid_;
+    std::atomic<unsigned int> srv_nonce_;
+    std::atomic<bool> bind_done_;
+    std::atomic<unsigned long long> bound_on_; // serial of the binding connection
+    std::atomic<unsigned int> xid_;
     int lossytest_;
     bool retrans_;
 
     connection *chan_;
 
-    pthread_mutex_t m_; // protect insert/delete to calls[]
+    pthread_mutex_t m_; // protect asynchronous calls
     pthread_mutex_t chan_m_;
-
-    std::map<int, caller *> calls_;
-    std::list<unsigned int> xid_rep_window_;
+    pthread_mutex_t xid_rep_m_; // protect xid_rep_ and xid_rep_bits_
+
+    // every xid up to xid_rep_ has been replied to (or given up on).
+    // replies to the XID_REP_BITS xids after it are kept in a ring of
+    // bits indexed by xid % XID_REP_BITS; the bit of xid_rep_ + 1 is
+    // always clear.  the window matches the server's REPLY_WINDOW_MAX:
+    // a reply further ahead pushes xid_rep_ along, since the server
+    // has forgotten the older xids anyway
+    static const unsigned int XID_REP_BITS = 1 << 16;
+    unsigned int xid_rep_;
+    uint64_t xid_rep_bits_[XID_REP_BITS / 64];
+
+    // round-trip time estimates of dst_ in microseconds, after Jacobson
+    // and Karels; srtt_us_ is 0 until the first sample.  updated without
+    // a lock, since a lost update only loses one sample
+    std::atomic<int> srtt_us_;
+    std::atomic<int> rttvar_us_;
+
+    // folds in the round trip of a call answered without retransmitting
+    void rtt_sample(long long us);
+
+    // timers of completed asynchronous calls whose callback was already
+    // running when the call completed, by xid
+    std::map<unsigned int, TimerMgr::timer_id> zombie_timers_;
+
+    // the last failover scheduled by dead_conn, and whether it has yet to
+    // start; closing_ stops new ones.  protected by m_
+    TimerMgr::timer_id failover_timer_;
+    bool failover_pending_;
+    bool closing_;
+    std::atomic<unsigned int> failovers_;
+
+    // TimerMgr callback after the connection died: starts a reconnect,
+    // which resends every pending call once it is up
+    void failover();
+
+    // connection setup, protected by chan_m_.  at most one connect to
+    // dst_ is in flight.  after a failure the next one waits until
+    // next_connect_ms_, a jittered backoff that doubles with every
+    // consecutive failure; chan_closing_ stops new ones
+    bool connecting_;
+    bool chan_closing_;
+    bool connected_once_;
+    int connect_fails_;
+    long long next_connect_ms_;
+    TimerMgr::timer_id connect_timer_; // retry after the backoff
+    pthread_cond_t connect_c_;         // connecting_ cleared
+    // connects started, and the number of the last one that failed.  a
+    // call issued when connects_ was n fails fast once failed_connect_
+    // passes n, if its request never went out
+    std::atomic<unsigned int> connects_;
+    std::atomic<unsigned int> failed_connect_;
+
+    // starts a connect to dst_, unless one is in flight or backing off.
+    // assumes thread holds chan_m_
+    void start_connect();
+
+    // TimerMgr callback at the end of a backoff
+    void retry_connect();
+
+    // completion of the connect; c is NULL if it failed
+    void connected(connection *c);
+
+    // wakes synchronous callers and resends asynchronous calls that are
+    // not on ch
+    void resume_calls(connection *ch);
+
+    // after a failed connect: wakes synchronous callers and fails the
+    // asynchronous calls that never went out
+    void fail_unsent();
+
+    // calls f on every WAITING slot, with its caller if asynchronous.
+    // assumes thread holds m_
+    void walk_waiting(const std::function<void(slot_t *, caller *)> &f);
+
+    // circuit breaker of dst_.  BREAKER_FAILURES failures in a row (calls
+    // that timed out, failed connects) open it, and calls then fail at
+    // once with unavailable_failure instead of waiting out their timeout.
+    // after BREAKER_OPEN_MS it is half-open: one call every BREAKER_OPEN_MS
+    // goes through as a probe.  any reply closes it; a failure opens it
+    // again.  the fast path reads the state without a lock; changes are
+    // made under breaker_m_
+    enum { BREAKER_CLOSED = 0, BREAKER_OPEN, BREAKER_HALF_OPEN };
+    std::atomic<int> breaker_;
+    std::atomic<int> breaker_fails_;     // consecutive failures
+    long long breaker_probe_ms_;         // when the next probe may go
+    std::atomic<unsigned int> breaker_trips_;
+    pthread_mutex_t breaker_m_;
+
+    // whether a new call may go to dst_, perhaps as the probe
+    bool breaker_admit();
+
+    // records whether dst_ answered a call, or failed a call or connect
+    void breaker_result(bool ok);
+
+    bool breaker_open() { return breaker_.load() == BREAKER_OPEN; }
 
 public:
 
@@ -89,51 +278,58 @@ public:
 
     unsigned int id() { return clt_nonce_; }
 
+    // the first retransmission timeout of a call, in milliseconds: to_min
+    // until a round trip has been measured, then srtt + 4 * rttvar,
+    // within [RTO_MIN_MS, to_min]
+    int rto();
+
+    // binds the client to the current instance of the server, after
+    // which calls that reach another instance fail with oldsrv_failure.
+    // optional: the reply to the first call binds the client as well.
+    // until then a request that may have reached the server goes out
+    // again on a new connection only if the client was bound over the
+    // old one, and fails with oldsrv_failure otherwise
     int bind(TO to = to_max);
 
     int call1(unsigned int proc,
               marshall &req, unmarshall &rep, TO to);
 
-    bool got_pdu(connection *c, char *b, int sz);
-
-
-    template<class R>
-    int call_m(unsigned int proc, marshall &req, R &r, TO to);
+    // like call1, but returns as soon as the request is sent and
+    // reports the outcome through cb
+    void async_call1(unsigned int proc, marshall &req, callback_t cb, TO to);
 
-    template<class R>
-    int call(unsigned int proc, R &r, TO to = to_max);
+    bool got_pdu(connection *c, rpcbuf *b, char *pdu, int sz);
 
-    template<class R, class A1>
-    int call(unsigned int proc, const A1 &a1, R &r, TO to = to_max);
+    void dead_conn(connection *c);
 
-    template<class R, class A1, class A2>
-    int call(unsigned int proc, const A1 &a1, const A2 &a2, R &r,
-             TO to = to_max);
+    // how many times the connection to dst was replaced by a new one
+    unsigned int failovers() { return failovers_.load(); }
 
-    template<class R, class A1, class A2, class A3>
-    int call(unsigned int proc, const A1 &a1, const A2 &a2, const A3 &a3,
-             R &r, TO to = to_max);
+    // how many times the circuit breaker of dst opened
+    unsigned int trips() { return breaker_trips_.load(); }
 
-    template<class R, class A1, class A2, class A3, class A4>
-    int call(unsigned int proc, const A1 &a1, const A2 &a2, const A3 &a3,
-             const A4 &a4, R &r, TO to = to_max);
+    template<class R>
+    int call_m(unsigned int proc, marshall &req, R &r, TO to);
 
-    template<class R, class A1, class A2, class A3, class A4, class A5>
-    int call(unsigned int proc, const A1 &a1, const A2 &a2, const A3 &a3,
-             const A4 &a4, const A5 &a5, R &r, TO to = to_max);
+    template<class R>
+    void async_call_m(unsigned int proc, marshall &req,
+                      std::function<void(int, R &)> cb, TO to = to_max);
 
-    template<class R, class A1, class A2, class A3, class A4, class A5,
-            class A6>
-    int call(unsigned int proc, const A1 &a1, const A2 &a2, const A3 &a3,
-             const A4 &a4, const A5 &a5, const A6 &a6,
-             R &r, TO to = to_max);
+    // r must stay valid until the future is ready
+    template<class R>
+    std::future<int> async_call_m(unsigned int proc, marshall &req, R &r,
+                                  TO to = to_max);
 
-    template<class R, class A1, class A2, class A3, class A4, class A5,
-            class A6, class A7>
-    int call(unsigned int proc, const A1 &a1, const A2 &a2, const A3 &a3,
-             const A4 &a4, const A5 &a5, const A6 &a6, const A7 &a7,
-             R &r, TO to = to_max);
+    // call(proc, a1, ..., an, r [, to]): marshalls the arguments, sends
+    // the request and unmarshalls the reply into r.  rvalue arguments are
+    // moved into the request; large lvalue strings are sent in place.
+    template<class... Args>
+    int call(unsigned int proc, Args &&... args);
 
+private:
+    template<class Tuple, size_t... I, class R>
+    int call_t(unsigned int proc, Tuple &&t, std::index_sequence<I...>,
+               R &r, TO to);
 };
 
 template<class R>
@@ -148,89 +344,57 @@ int rpcc::call_m(unsigned int proc, marshall &req, R &r, TO to) {
 }
 
 template<class R>
-int rpcc::call(unsigned int proc, R &r, TO to) {
-    marshall m;
-    return call_m(proc, m, r, to);
-}
-
-template<class R, class A1>
-int rpcc::call(unsigned int proc, const A1 &a1, R &r, TO to) {
-    marshall m;
-    m << a1;
-    return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2>
-int rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
-               R &r, TO to) {
-    marshall m;
-    m << a1;
-    m << a2;
-    return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2, class A3>
-int rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
-               const A3 &a3, R &r, TO to) {
-    marshall m;
-    m << a1;
-    m << a2;
-    m << a3;
-    return call_m(proc, m, r, to);
-}
-
-template<class R, class A1, class A2, class A3, class A4>
-int rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
-               const A3 &a3, const A4 &a4, R &r, TO to) {
-    marshall m;
-    m << a1;
-    m << a2;
-    m << a3;
-    m << a4;
-    return call_m(proc, m, r, to);
+void rpcc::async_call_m(unsigned int proc, marshall &req,
+                        std::function<void(int, R &)> cb, TO to) {
+    async_call1(proc, req, [cb](int intret, unmarshall &u) {
+        R r;
+        if (intret >= 0) {
+            u >> r;
+            if (u.okdone() != true)
+                intret = rpc_const::unmarshal_reply_failure;
+        }
+        cb(intret, r);
+    }, to);
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5>
-int rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
-               const A3 &a3, const A4 &a4, const A5 &a5, R &r, TO to) {
-    marshall m;
-    m << a1;
-    m << a2;
-    m << a3;
-    m << a4;
-    m << a5;
-    return call_m(proc, m, r, to);
+template<class R>
+std::future<int> rpcc::async_call_m(unsigned int proc, marshall &req, R &r,
+                                    TO to) {
+    std::shared_ptr<std::promise<int> > p(new std::promise<int>());
+    R *rp = &r;
+    async_call1(proc, req, [p, rp](int intret, unmarshall &u) {
+        if (intret >= 0) {
+            u >> *rp;
+            if (u.okdone() != true)
+                intret = rpc_const::unmarshal_reply_failure;
+        }
+        p->set_value(intret);
+    }, to);
+    return p->get_future();
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-        class A6>
-int rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
-               const A3 &a3, const A4 &a4, const A5 &a5,
-               const A6 &a6, R &r, TO to) {
-    marshall m;
-    m << a1;
-    m << a2;
-    m << a3;
-    m << a4;
-    m << a5;
-    m << a6;
-    return call_m(proc, m, r, to);
+template<class... Args>
+int rpcc::call(unsigned int proc, Args &&... args) {
+    constexpr size_t n = sizeof...(Args);
+    static_assert(n > 0, "call needs a reply argument");
+    auto t = std::forward_as_tuple(std::forward<Args>(args)...);
+    typedef std::decay_t<std::tuple_element_t<n - 1, decltype(t)> > last_t;
+    if constexpr (std::is_same<last_t, TO>::value) {
+        static_assert(n > 1, "call needs a reply argument");
+        return call_t(proc, std::move(t), std::make_index_sequence<n - 2>(),
+                      std::get<n - 2>(t), std::get<n - 1>(t));
+    } else {
+        return call_t(proc, std::move(t), std::make_index_sequence<n - 1>(),
+                      std::get<n - 1>(t), to_max);
+    }
 }
 
-template<class R, class A1, class A2, class A3, class A4, class A5,
-        class A6, class A7>
-int rpcc::call(unsigned int proc, const A1 &a1, const A2 &a2,
-               const A3 &a3, const A4 &a4, const A5 &a5,
-               const A6 &a6, const A7 &a7,
-               R &r, TO to) {
+template<class Tuple, size_t... I, class R>
+int rpcc::call_t(unsigned int proc, Tuple &&t, std::index_sequence<I...>,
+                 R &r, TO to) {
     marshall m;
-    m << a1;
-    m << a2;
-    m << a3;
-    m << a4;
-    m << a5;
-    m << a6;
-    m << a7;
+    m.set_borrow(true);
+    (m << ... << std::get<I>(std::move(t)));
     return call_m(proc, m, r, to);
 }
 
@@ -245,6 +409,43 @@ public:
     virtual int fn(unmarshall &, marshall &) = 0;
 };
 
+// handler for int S::meth(A1 a1, ..., An an, R &r).  the arguments are
+// unmarshalled into a tuple and moved into the call, so meth may take them
+// by value, const reference or rvalue reference; r is moved into the reply.
+template<class S, class... Params>
+class method_handler : public handler {
+private:
+    typedef int (S::*meth_t)(Params...);
+    typedef std::tuple<Params...> params_t;
+    static constexpr size_t nargs = sizeof...(Params) - 1;
+    typedef std::tuple_element_t<nargs, params_t> rref_t;
+    static_assert(std::is_lvalue_reference<rref_t>::value
+                  && !std::is_const<std::remove_reference_t<rref_t> >::value,
+                  "a handler's last parameter is its reply, R &r");
+
+    S *sob_;
+    meth_t meth_;
+
+    template<size_t... I>
+    int call(unmarshall &args, marshall &ret, std::index_sequence<I...>) {
+        std::tuple<std::decay_t<std::tuple_element_t<I, params_t> >...> a;
+        (void)(args >> ... >> std::get<I>(a));
+        if (!args.okdone())
+            return rpc_const::unmarshal_args_failure;
+        std::remove_reference_t<rref_t> r;
+        int b = (sob_->*meth_)(std::move(std::get<I>(a))..., r);
+        ret << std::move(r);
+        return b;
+    }
+
+public:
+    method_handler(S *sob, meth_t meth) : sob_(sob), meth_(meth) {}
+
+    int fn(unmarshall &args, marshall &ret) {
+        return call(args, ret, std::make_index_sequence<nargs>());
+    }
+};
+
 
 // rpc server endpoint.
 class rpcs : public chanmgr {
@@ -258,42 +459,106 @@ class rpcs : public chanmgr {
 
 private:
 
+    // the slot of one xid in a client's reply window
     struct reply_t {
-        reply_t(unsigned int _xid) {
-            xid = _xid;
-            cb_present = false;
-            buf = NULL;
-            sz = 0;
-        }
+        reply_t() : seen(false), cb_present(false), evicted(false),
+                    buf(NULL), sz(0) {}
 
-        unsigned int xid;
-        bool cb_present;
-        char *buf;
+        bool seen;       // the request has arrived
+        bool cb_present; // and its reply is in buf
+        bool evicted;    // its reply was dropped to stay within budget
+        rpcbuf *buf;
         int sz;
     };
 
+    // the replies a client hasn't acknowledged receiving yet.  the slot
+    // of xid is replies[xid - base]; the client has acknowledged every
+    // xid below base, so the window is trimmed from the front as the
+    // client's xid_rep advances
+    struct client_t {
+        unsigned int base;
+        std::deque<reply_t> replies;
+        size_t bytes;            // held by its cached replies
+        unsigned int evict_xid;  // no slot below it holds a reply
+        unsigned int running;    // its requests whose handlers still run
+        unsigned long long seen; // req_seq_ when last heard from
+        long long last_ms;       // and when, on the monotonic clock
+    };
+
+    // reply windows are sharded by client nonce, each shard with its lock
+    static const unsigned int REPLY_SHARDS = 16;
+    // most xids a client may be ahead of its acknowledged ones
+    static const unsigned int REPLY_WINDOW_MAX = 1 << 16;
+
+    struct reply_shard_t {
+        pthread_mutex_t m;
+        std::unordered_map<unsigned int, client_t> clients;
+    };
+
     int port_;
     unsigned int nonce_;
 
     // provide at most once semantics by maintaining a window of replies
     // per client that that client hasn't acknowledged receiving yet.
-    std::map<unsigned int, std::list<reply_t> > reply_window_;
+    reply_shard_t reply_shards_[REPLY_SHARDS];
+
+    reply_shard_t &reply_shard(unsigned int clt_nonce) {
+        return reply_shards_[clt_nonce % REPLY_SHARDS];
+    }
 
     void free_reply_window(void);
 
-    auto search_reply(unsigned int client_id, unsigned int req_id);
+    // byte budgets for cached replies and their accounting
+    size_t reply_client_budget_;
+    size_t reply_budget_;
+    std::atomic<long long> reply_bytes_;
+    std::atomic<unsigned long long> reply_count_;
+    std::atomic<unsigned long long> reply_evicted_;
+    std::atomic<unsigned long long> reply_forgotten_;
+    std::atomic<unsigned long long> req_seq_;
+    pthread_mutex_t evict_m_; // one thread at a time evicts globally
 
-    void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
+    // drops a cached reply, marking it evicted if asked to; assumes
+    // the thread holds the client's shard lock
+    void drop_reply(client_t &clt, reply_t &reply, bool evict);
+
+    // evicts the client's oldest cached reply; false if it has none
+    bool evict_oldest(client_t &clt);
+
+    // evicts replies of the least recently heard from clients until
+    // all replies fit well within reply_budget_
+    void evict_global();
+
+    void add_reply(unsigned int clt_nonce, unsigned int xid, rpcbuf *b, int sz);
 
     rpcstate_t checkduplicate_and_update(unsigned int clt_nonce,
                                          unsigned int xid, unsigned int rep_xid,
-                                         char **b, int *sz);
+                                         rpcbuf **b, int *sz);
 
     void updatestat(unsigned int proc);
 
     // latest connection to the client
     std::map<unsigned int, connection *> conns_;
 
+    // sessions, i.e. a client's reply window and its entry in conns_,
+    // expire after session_ttl_ms_ without a request from the client,
+    // but not while a handler runs one of its requests, or a retransmit
+    // would run the request again; dead connections are released from
+    // conns_ at the next reaping
+    int session_ttl_ms_;
+    std::atomic<unsigned long long> sessions_reaped_;
+    std::atomic<unsigned long long> conns_released_;
+    pthread_mutex_t reap_m_; // protects reap_timer_ and reap_stopped_
+    TimerMgr::timer_id reap_timer_;
+    bool reap_stopped_;
+
+    // TimerMgr callback: expires idle sessions, then runs again
+    void reap();
+
+    // (re)starts the reaper at an interval to suit session_ttl_ms_;
+    // assumes the thread holds reap_m_
+    void schedule_reap();
+
     // counting
     const int counting_;
     int curr_counts_;
@@ -306,16 +571,16 @@ private:
 
     pthread_mutex_t procs_m_; // protect insert/delete to procs[]
     pthread_mutex_t count_m_;  //protect modification of counts
-    pthread_mutex_t reply_window_m_; // protect reply window et al
     pthread_mutex_t conss_m_; // protect conns_
 
 
 protected:
 
     struct djob_t {
-        djob_t(connection *c, char *b, int bsz) : buf(b), sz(bsz), conn(c) {}
+        djob_t(connection *c, rpcbuf *b, char *p, int bsz) : buf(b), pdu(p), sz(bsz), conn(c) {}
 
-        char *buf;
+        rpcbuf *buf;
+        char *pdu;
         int sz;
         connection *conn;
     };
@@ -336,287 +601,45 @@ public:
     //RPC handler for clients binding
     int rpcbind(int a, int &r);
 
-    bool got_pdu(connection *c, char *b, int sz);
-
-    // register a handler
-    template<class S, class A1, class R>
-    void reg(unsigned int proc, S *, int (S::*meth)(const A1 a1, R &r));
-
-    template<class S, class A1, class A2, class R>
-    void reg(unsigned int proc, S *, int (S::*meth)(const A1 a1, const A2,
-                                                    R &r));
-
-    template<class S, class A1, class A2, class A3, class R>
-    void reg(unsigned int proc, S *, int (S::*meth)(const A1, const A2,
-                                                    const A3, R &r));
-
-    template<class S, class A1, class A2, class A3, class A4, class R>
-    void reg(unsigned int proc, S *, int (S::*meth)(const A1, const A2,
-                                                    const A3, const A4, R &r));
-
-    template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-    void reg(unsigned int proc, S *, int (S::*meth)(const A1, const A2,
-                                                    const A3, const A4, const A5,
-                                                    R &r));
-
-    template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-            class R>
-    void reg(unsigned int proc, S *, int (S::*meth)(const A1, const A2,
-                                                    const A3, const A4, const A5,
-                                                    const A6, R &r));
-
-    template<class S, class A1, class A2, class A3, class A4, class A5, class A6,
-            class A7, class R>
-    void reg(unsigned int proc, S *, int (S::*meth)(const A1, const A2,
-                                                    const A3, const A4, const A5,
-                                                    const A6, const A7,
-                                                    R &r));
-};
+    bool got_pdu(connection *c, rpcbuf *b, char *pdu, int sz);
 
-template<class S, class A1, class R>
-void rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(const A1 a1, R &r)) {
-    class h1 : public handler {
-    private:
-        S *sob;
-
-        int (S::*meth)(const A1 a1, R &r);
-
-    public:
-        h1(S *xsob, int (S::*xmeth)(const A1 a1, R &r))
-                : sob(xsob), meth(xmeth) {}
-
-        int fn(unmarshall &args, marshall &ret) {
-            A1 a1;
-            R r;
-            args >> a1;
-            if (!args.okdone())
-                return rpc_const::unmarshal_args_failure;
-            int b = (sob->*meth)(a1, r);
-            ret << r;
-            return b;
-        }
+    // counters of the at-most-once reply cache
+    struct reply_stats_t {
+        unsigned long long bytes;     // held by cached replies
+        unsigned long long replies;   // cached replies
+        unsigned long long evicted;   // replies evicted to stay within budget
+        unsigned long long forgotten; // duplicates answered atmostonce_failure
     };
-    reg1(proc, new h1(sob, meth));
-}
 
-template<class S, class A1, class A2, class R>
-void rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(const A1 a1, const A2 a2,
-                                                         R &r)) {
-    class h1 : public handler {
-    private:
-        S *sob;
-
-        int (S::*meth)(const A1 a1, const A2 a2, R &r);
-
-    public:
-        h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, R &r))
-                : sob(xsob), meth(xmeth) {}
-
-        int fn(unmarshall &args, marshall &ret) {
-            A1 a1;
-            A2 a2;
-            R r;
-            args >> a1;
-            args >> a2;
-            if (!args.okdone())
-                return rpc_const::unmarshal_args_failure;
-            int b = (sob->*meth)(a1, a2, r);
-            ret << r;
-            return b;
-        }
-    };
-    reg1(proc, new h1(sob, meth));
-}
+    reply_stats_t reply_stats();
 
-template<class S, class A1, class A2, class A3, class R>
-void rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(const A1 a1, const A2 a2,
-                                                         const A3 a3, R &r)) {
-    class h1 : public handler {
-    private:
-        S *sob;
-
-        int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, R &r);
-
-    public:
-        h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3, R &r))
-                : sob(xsob), meth(xmeth) {}
-
-        int fn(unmarshall &args, marshall &ret) {
-            A1 a1;
-            A2 a2;
-            A3 a3;
-            R r;
-            args >> a1;
-            args >> a2;
-            args >> a3;
-            if (!args.okdone())
-                return rpc_const::unmarshal_args_failure;
-            int b = (sob->*meth)(a1, a2, a3, r);
-            ret << r;
-            return b;
-        }
-    };
-    reg1(proc, new h1(sob, meth));
-}
+    // limits the bytes cached replies may hold, per client and in all.
+    // the oldest replies are evicted to stay within them, and duplicates
+    // of evicted requests fail with atmostonce_failure
+    void set_reply_budget(size_t per_client, size_t total);
 
-template<class S, class A1, class A2, class A3, class A4, class R>
-void rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(const A1 a1, const A2 a2,
-                                                         const A3 a3, const A4 a4,
-                                                         R &r)) {
-    class h1 : public handler {
-    private:
-        S *sob;
-
-        int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4, R &r);
-
-    public:
-        h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3,
-                                    const A4 a4, R &r))
-                : sob(xsob), meth(xmeth) {}
-
-        int fn(unmarshall &args, marshall &ret) {
-            A1 a1;
-            A2 a2;
-            A3 a3;
-            A4 a4;
-            R r;
-            args >> a1;
-            args >> a2;
-            args >> a3;
-            args >> a4;
-            if (!args.okdone())
-                return rpc_const::unmarshal_args_failure;
-            int b = (sob->*meth)(a1, a2, a3, a4, r);
-            ret << r;
-            return b;
-        }
+    // counters of client sessions
+    struct session_stats_t {
+        unsigned long long sessions;       // clients with a reply window
+        unsigned long long conns;          // connections held in conns_
+        unsigned long long reaped;         // sessions expired
+        unsigned long long conns_released; // conns_ references dropped
     };
-    reg1(proc, new h1(sob, meth));
-}
 
-template<class S, class A1, class A2, class A3, class A4, class A5, class R>
-void rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(const A1 a1, const A2 a2,
-                                                         const A3 a3, const A4 a4,
-                                                         const A5 a5, R &r)) {
-    class h1 : public handler {
-    private:
-        S *sob;
-
-        int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4,
-                       const A5 a5, R &r);
-
-    public:
-        h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3,
-                                    const A4 a4, const A5 a5, R &r))
-                : sob(xsob), meth(xmeth) {}
-
-        int fn(unmarshall &args, marshall &ret) {
-            A1 a1;
-            A2 a2;
-            A3 a3;
-            A4 a4;
-            A5 a5;
-            R r;
-            args >> a1;
-            args >> a2;
-            args >> a3;
-            args >> a4;
-            args >> a5;
-            if (!args.okdone())
-                return rpc_const::unmarshal_args_failure;
-            int b = (sob->*meth)(a1, a2, a3, a4, a5, r);
-            ret << r;
-            return b;
-        }
-    };
-    reg1(proc, new h1(sob, meth));
-}
+    session_stats_t session_stats();
 
-template<class S, class A1, class A2, class A3, class A4, class A5, class A6, class R>
-void rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(const A1 a1, const A2 a2,
-                                                         const A3 a3, const A4 a4,
-                                                         const A5 a5, const A6 a6,
-                                                         R &r)) {
-    class h1 : public handler {
-    private:
-        S *sob;
-
-        int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4,
-                       const A5 a5, const A6 a6, R &r);
-
-    public:
-        h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3,
-                                    const A4 a4, const A5 a5, const A6 a6, R &r))
-                : sob(xsob), meth(xmeth) {}
-
-        int fn(unmarshall &args, marshall &ret) {
-            A1 a1;
-            A2 a2;
-            A3 a3;
-            A4 a4;
-            A5 a5;
-            A6 a6;
-            R r;
-            args >> a1;
-            args >> a2;
-            args >> a3;
-            args >> a4;
-            args >> a5;
-            args >> a6;
-            if (!args.okdone())
-                return rpc_const::unmarshal_args_failure;
-            int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, r);
-            ret << r;
-            return b;
-        }
-    };
-    reg1(proc, new h1(sob, meth));
-}
+    // a client's session expires after ms without a request from it.
+    // it must outlast the clients' retransmissions, as a duplicate that
+    // arrives after its session expired runs again
+    void set_session_ttl(int ms);
 
-template<class S, class A1, class A2, class A3, class A4, class A5,
-        class A6, class A7, class R>
-void rpcs::reg(unsigned int proc, S *sob, int (S::*meth)(const A1 a1, const A2 a2,
-                                                         const A3 a3, const A4 a4,
-                                                         const A5 a5, const A6 a6,
-                                                         const A7 a7, R &r)) {
-    class h1 : public handler {
-    private:
-        S *sob;
-
-        int (S::*meth)(const A1 a1, const A2 a2, const A3 a3, const A4 a4,
-                       const A5 a5, const A6 a6, const A7 a7, R &r);
-
-    public:
-        h1(S *xsob, int (S::*xmeth)(const A1 a1, const A2 a2, const A3 a3,
-                                    const A4 a4, const A5 a5, const A6 a6,
-                                    const A7 a7, R &r))
-                : sob(xsob), meth(xmeth) {}
-
-        int fn(unmarshall &args, marshall &ret) {
-            A1 a1;
-            A2 a2;
-            A3 a3;
-            A4 a4;
-            A5 a5;
-            A6 a6;
-            A7 a7;
-            R r;
-            args >> a1;
-            args >> a2;
-            args >> a3;
-            args >> a4;
-            args >> a5;
-            args >> a6;
-            args >> a7;
-            if (!args.okdone())
-                return rpc_const::unmarshal_args_failure;
-            int b = (sob->*meth)(a1, a2, a3, a4, a5, a6, a7, r);
-            ret << r;
-            return b;
-        }
-    };
-    reg1(proc, new h1(sob, meth));
-}
+    // register a handler, int S::meth(A1 a1, ..., An an, R &r)
+    template<class S, class... Params>
+    void reg(unsigned int proc, S *sob, int (S::*meth)(Params...)) {
+        static_assert(sizeof...(Params) > 0, "a handler needs a reply argument");
+        reg1(proc, new method_handler<S, Params...>(sob, meth));
+    }
+};
 
 
 void make_sockaddr(const char *hostandport, struct sockaddr_in *dst);
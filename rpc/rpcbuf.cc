@@ -0,0 +1,329 @@
+#include <pthread.h>
+#include <string.h>
+#include <algorithm>
+
+#include "slock.h"
+#include "rpcbuf.h"
+
+#define MIN_SHIFT 6 //smallest size class is 64 bytes
+#define NCLASSES 15 //size classes 64, 128, ... 1M
+#define CACHE_BYTES (64<<10) //free bytes a thread caches per class
+#define SHARED_BYTES (4<<20) //free bytes the shared list keeps per class
+
+// the free buffers and counters of one thread.  only the owning thread
+// changes them; stats() reads the counters from other threads.
+struct rpcbuf_cache {
+	rpcbuf *head[NCLASSES];
+	int n[NCLASSES];
+	std::atomic<unsigned long long> allocs;
+	std::atomic<unsigned long long> heap_allocs;
+	std::atomic<unsigned long long> heap_frees;
+	rpcbuf_cache *prev, *next; //on the list of live caches
+
+	rpcbuf_cache();
+	~rpcbuf_cache();
+	rpcbuf *get(int cls);
+	void put(rpcbuf *b);
+};
+
+// protects the shared free lists, the list of live caches and the
+// counters of exited threads
+static pthread_mutex_t pool_m = PTHREAD_MUTEX_INITIALIZER;
+static rpcbuf *shared_head[NCLASSES];
+static int shared_n[NCLASSES];
+static rpcbuf_cache *live_caches;
+static rpcbuf::stats_t exited;
+
+static pthread_once_t cache_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t cache_key;
+static __thread rpcbuf_cache *my_cache;
+
+static inline void
+bump(std::atomic<unsigned long long> &c)
+{
+	c.store(c.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+}
+
+static inline int
+class_size(int cls)
+{
+	return 1 << (cls + MIN_SHIFT);
+}
+
+// buffers a thread caches per class before handing half of them over.
+// small, since buffers a thread frees but does not allocate sit idle
+static inline int
+cache_max(int cls)
+{
+	int n = CACHE_BYTES / class_size(cls);
+	return n < 4 ? 4 : (n > 16 ? 16 : n);
+}
+
+static void
+delete_cache(void *c)
+{
+	delete (rpcbuf_cache *)c;
+	my_cache = NULL;
+}
+
+static void
+make_cache_key()
+{
+	assert(pthread_key_create(&cache_key, delete_cache) == 0);
+}
+
+static inline rpcbuf_cache *
+cache()
+{
+	if (!my_cache) {
+		pthread_once(&cache_key_once, make_cache_key);
+		my_cache = new rpcbuf_cache();
+		assert(pthread_setspecific(cache_key, my_cache) == 0);
+	}
+	return my_cache;
+}
+
+rpcbuf_cache::rpcbuf_cache() : allocs(0), heap_allocs(0), heap_frees(0), prev(NULL)
+{
+	memset(head, 0, sizeof(head));
+	memset(n, 0, sizeof(n));
+
+	ScopedLock ml(&pool_m);
+	next = live_caches;
+	if (next)
+		next->prev = this;
+	live_caches = this;
+}
+
+//the thread exits: its free buffers go to the shared lists, or the
+//heap if those are full
+rpcbuf_cache::~rpcbuf_cache()
+{
+	ScopedLock ml(&pool_m);
+	for (int cls = 0; cls < NCLASSES; cls++) {
+		while (head[cls]) {
+			rpcbuf *b = head[cls];
+			head[cls] = b->next_;
+			if (shared_n[cls] * class_size(cls) < SHARED_BYTES) {
+				b->next_ = shared_head[cls];
+				shared_head[cls] = b;
+				shared_n[cls]++;
+			} else {
+				free(b);
+				exited.heap_frees++;
+			}
+		}
+	}
+	exited.allocs += allocs.load();
+	exited.heap_allocs += heap_allocs.load();
+	exited.heap_frees += heap_frees.load();
+
+	if (prev)
+		prev->next = next;
+	else
+		live_caches = next;
+	if (next)
+		next->prev = prev;
+}
+
+rpcbuf *
+rpcbuf_cache::get(int cls)
+{
+	if (!head[cls]) {
+		//refill half the cache from the shared list
+		ScopedLock ml(&pool_m);
+		for (int i = cache_max(cls) / 2; i > 0 && shared_head[cls]; i--) {
+			rpcbuf *b = shared_head[cls];
+			shared_head[cls] = b->next_;
+			shared_n[cls]--;
+			b->next_ = head[cls];
+			head[cls] = b;
+			n[cls]++;
+		}
+	}
+
+	rpcbuf *b = head[cls];
+	if (b) {
+		head[cls] = b->next_;
+		n[cls]--;
+	}
+	return b;
+}
+
+void
+rpcbuf_cache::put(rpcbuf *b)
+{
+	int cls = b->cls_;
+	b->next_ = head[cls];
+	head[cls] = b;
+	n[cls]++;
+	if (n[cls] < cache_max(cls))
+		return;
+
+	//hand half the cache to the shared list, so that a thread that
+	//frees what others allocate does not hoard buffers
+	rpcbuf *spill = NULL;
+	for (int i = n[cls] / 2; i > 0; i--) {
+		rpcbuf *x = head[cls];
+		head[cls] = x->next_;
+		n[cls]--;
+		x->next_ = spill;
+		spill = x;
+	}
+
+	ScopedLock ml(&pool_m);
+	while (spill) {
+		rpcbuf *x = spill;
+		spill = x->next_;
+		if (shared_n[cls] * class_size(cls) < SHARED_BYTES) {
+			x->next_ = shared_head[cls];
+			shared_head[cls] = x;
+			shared_n[cls]++;
+		} else {
+			free(x);
+			bump(heap_frees);
+		}
+	}
+}
+
+rpcbuf *
+rpcbuf::alloc(int capa)
+{
+	rpcbuf_cache *c = cache();
+	bump(c->allocs);
+
+	int cls = 0;
+	if (capa > class_size(0))
+		cls = 32 - __builtin_clz(capa - 1) - MIN_SHIFT;
+
+	if (cls >= NCLASSES) {
+		void *p = malloc(sizeof(rpcbuf) + capa);
+		assert(p);
+		bump(c->heap_allocs);
+		return new (p) rpcbuf(capa, -1);
+	}
+
+	rpcbuf *b = c->get(cls);
+	if (b) {
+		b->refs_.store(1, std::memory_order_relaxed);
+		b->next_ = NULL;
+		b->segs_ = NULL;
+		b->seg_bytes_ = b->borrows_ = 0;
+		return b;
+	}
+
+	void *p = malloc(sizeof(rpcbuf) + class_size(cls));
+	assert(p);
+	bump(c->heap_allocs);
+	return new (p) rpcbuf(class_size(cls), cls);
+}
+
+void
+rpcbuf::release(rpcbuf *b)
+{
+	if (b->segs_)
+		b->drop_segs();
+
+	rpcbuf_cache *c = cache();
+	if (b->cls_ < 0) {
+		b->~rpcbuf();
+		free(b);
+		bump(c->heap_frees);
+	} else {
+		c->put(b);
+	}
+}
+
+rpcbuf *
+rpcbuf::grow(int capa, int used)
+{
+	assert(!shared());
+	if (capa <= capa_)
+		return this;
+
+	rpcbuf *b = alloc(capa);
+	memcpy(b->data(), data(), used);
+	std::swap(b->segs_, segs_);
+	std::swap(b->seg_bytes_, seg_bytes_);
+	std::swap(b->borrows_, borrows_);
+	decref();
+	return b;
+}
+
+void
+rpcbuf::add_seg(const rpcseg &g)
+{
+	if (!segs_)
+		segs_ = new std::vector<rpcseg>();
+	assert(segs_->empty() || segs_->back().off <= g.off);
+	segs_->push_back(g);
+	seg_bytes_ += g.len;
+	if (!g.rb && !g.s)
+		borrows_++;
+}
+
+void
+rpcbuf::own_borrowed()
+{
+	if (!borrows_)
+		return;
+	for (unsigned int i = 0; i < segs_->size(); i++) {
+		rpcseg &g = (*segs_)[i];
+		if (!g.rb && !g.s) {
+			g.s = new std::string(g.p, g.len);
+			g.p = g.s->data();
+		}
+	}
+	borrows_ = 0;
+}
+
+size_t
+rpcbuf::footprint() const
+{
+	size_t n = capa_;
+	if (!segs_)
+		return n;
+	for (unsigned int i = 0; i < segs_->size(); i++) {
+		const rpcseg &g = (*segs_)[i];
+		if (g.s) {
+			n += g.s->capacity();
+		} else if (g.rb) {
+			//a received buffer holds many slices; count it once
+			bool seen = false;
+			for (unsigned int j = 0; j < i && !seen; j++)
+				seen = (*segs_)[j].rb == g.rb;
+			if (!seen)
+				n += g.rb->capa();
+		} else {
+			n += g.len;
+		}
+	}
+	return n;
+}
+
+void
+rpcbuf::drop_segs()
+{
+	for (unsigned int i = 0; i < segs_->size(); i++) {
+		rpcseg &g = (*segs_)[i];
+		if (g.rb)
+			g.rb->decref();
+		delete g.s;
+	}
+	delete segs_;
+	segs_ = NULL;
+	seg_bytes_ = borrows_ = 0;
+}
+
+rpcbuf::stats_t
+rpcbuf::stats()
+{
+	ScopedLock ml(&pool_m);
+	stats_t s = exited;
+	for (rpcbuf_cache *c = live_caches; c; c = c->next) {
+		s.allocs += c->allocs.load(std::memory_order_relaxed);
+		s.heap_allocs += c->heap_allocs.load(std::memory_order_relaxed);
+		s.heap_frees += c->heap_frees.load(std::memory_order_relaxed);
+	}
+	return s;
+}
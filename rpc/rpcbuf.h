@@ -0,0 +1,94 @@
+#ifndef rpcbuf_h
+#define rpcbuf_h
+
+#include <assert.h>
+#include <stdlib.h>
+#include <atomic>
+#include <new>
+#include <string>
+#include <vector>
+
+class rpcbuf;
+
+// a run of PDU bytes kept outside the rpcbuf: len bytes at p, spliced in
+// at offset off of the rpcbuf's own bytes.  the segment keeps p alive
+// through a reference to rb or by owning s; with neither, p is borrowed
+// from the sender and valid only until the send using it returns.
+struct rpcseg {
+	int off;
+	const char *p;
+	int len;
+	rpcbuf *rb;
+	std::string *s;
+};
+
+// rpcbuf is a reference-counted byte buffer.  A PDU is built in one by
+// marshall and then handed to the connection's send queue, kept in the
+// reply window and retransmitted by reference rather than copied.
+// whoever holds a reference must call decref() when done with it.
+//
+// buffers come from a pool of power-of-two size classes (64 bytes to 1M).
+// each thread keeps a small cache of free buffers per class and trades
+// them in batches with a shared free list, so in steady state neither
+// alloc() nor decref() reaches malloc.  larger buffers use the heap.
+//
+// large payloads are not copied in: marshall attaches them as segments
+// (see rpcseg), which the connection writes out with writev.
+class rpcbuf {
+	public:
+		// a buffer of at least capa bytes; capa() tells the real size
+		static rpcbuf *alloc(int capa);
+
+		char *data() { return (char *)(this + 1); }
+		int capa() const { return capa_; }
+		bool shared() const { return refs_.load() > 1; }
+
+		void incref() { refs_.fetch_add(1); }
+		void decref() {
+			if (refs_.fetch_sub(1) == 1)
+				release(this);
+		}
+
+		// enlarge to at least capa bytes, keeping the first used bytes;
+		// only the sole owner may do this since the buffer may move
+		rpcbuf *grow(int capa, int used);
+
+		// segments, in order of offset; NULL if there are none
+		const std::vector<rpcseg> *segs() const { return segs_; }
+		int seg_bytes() const { return seg_bytes_; }
+		bool borrows() const { return borrows_ > 0; }
+		void add_seg(const rpcseg &g);
+		// copies borrowed segments, so the sender may free them
+		void own_borrowed();
+		// the bytes this buffer keeps alive: its own and, whole, the
+		// buffers its segments refer to
+		size_t footprint() const;
+
+		// pool counters, summed over all threads
+		struct stats_t {
+			unsigned long long allocs;      // alloc() calls
+			unsigned long long heap_allocs; // alloc()s that called malloc
+			unsigned long long heap_frees;  // buffers given back to the heap
+		};
+		static stats_t stats();
+
+	private:
+		friend struct rpcbuf_cache;
+
+		rpcbuf(int capa, int cls) : refs_(1), capa_(capa), cls_(cls), next_(NULL),
+			segs_(NULL), seg_bytes_(0), borrows_(0) {}
+		~rpcbuf() {}
+
+		static void release(rpcbuf *b);
+		void drop_segs();
+
+		std::atomic<int> refs_;
+		int capa_;
+		int cls_;      // size class, or -1 for a heap buffer
+		rpcbuf *next_; // link while on a free list
+		std::vector<rpcseg> *segs_;
+		int seg_bytes_;
+		int borrows_;  // number of borrowed segments
+};
+
+#endif /* rpcbuf_h */
@@ -8,12 +8,18 @@
 #include <getopt.h>
 
 #include <unistd.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
 #include <ios>
 #include <iostream>
+#include <set>
+#include <unordered_map>
+#include <unordered_set>
 #include <fstream>
 #include <string>
 
 #include "rpc.h"
+#include "slock.h"
 
 #include "jsl_log.h"
 #include "gettime.h"
@@ -30,6 +36,7 @@ rpcc *clients[NUM_CL];  // client rpc object
 struct sockaddr_in dst; //server's ip address
 int port;
 pthread_attr_t attr;
+char *progname;
 
 // server-side handlers. they must be methods of some class
 // to simplify rpcs::reg(). a server process can have handlers
@@ -40,6 +47,13 @@ class srv {
 		int handle_fast(const int a, int &r);
 		int handle_slow(const int a, int &r);
 		int handle_bigrep(const int a, std::string &r);
+		int handle_view(const rpcstr a, const rpcstr b, int &r);
+		int handle_many(const std::string &a, std::string &&b, int c,
+		    char d, short e, unsigned long long f,
+		    const std::vector<int> &g, std::vector<std::string> h,
+		    const std::map<int,int> &i, std::string &r);
+		int handle_sleep(const int ms, int &r);
+		int handle_echo(const rpcstr a, rpcstr &r);
 };
 
 
@@ -123,6 +137,44 @@ srv::handle_bigrep(const int len, std::string &r)
 	return 0;
 }
 
+// a and b point into the request; nothing was copied to make them
+int
+srv::handle_view(const rpcstr a, const rpcstr b, int &r)
+{
+	r = std::count(a.begin(), a.end(), 'x') + b.size();
+	return 0;
+}
+
+// more arguments than the old fixed-arity reg() allowed, taken by value,
+// const reference and rvalue reference
+int
+srv::handle_many(const std::string &a, std::string &&b, int c, char d,
+    short e, unsigned long long f, const std::vector<int> &g,
+    std::vector<std::string> h, const std::map<int,int> &i, std::string &r)
+{
+	r = std::move(b);
+	r += a;
+	for (unsigned int j = 0; j < h.size(); j++)
+		r += h[j];
+	return c + d + e + (int)(f >> 40) + g.size() + i.at(7);
+}
+
+int
+srv::handle_sleep(const int ms, int &r)
+{
+	usleep(ms * 1000);
+	r = ms;
+	return 0;
+}
+
+// the reply refers to the bytes of the request
+int
+srv::handle_echo(const rpcstr a, rpcstr &r)
+{
+	r = a;
+	return 0;
+}
+
 srv service;
 
 void startserver()
@@ -132,6 +184,10 @@ void startserver()
 	server->reg(23, &service, &srv::handle_fast);
 	server->reg(24, &service, &srv::handle_slow);
 	server->reg(25, &service, &srv::handle_bigrep);
+	server->reg(26, &service, &srv::handle_view);
+	server->reg(27, &service, &srv::handle_many);
+	server->reg(28, &service, &srv::handle_sleep);
+	server->reg(29, &service, &srv::handle_echo);
 }
 
 void
@@ -148,10 +204,12 @@ testmarshall()
 	m << l;
 	m << s;
 
-	char *b;
+	rpcbuf *b;
 	int sz;
 	m.take_buf(&b,&sz);
 	assert(sz == (int)(RPC_HEADER_SZ+sizeof(i)+sizeof(l)+s.size()+sizeof(int)));
+	// built inline, then copied into a buffer sized to fit
+	assert(b->capa() < RPC_INLINE_SZ);
 
 	unmarshall un(b,sz);
 	req_header rh1;
@@ -165,6 +223,251 @@ testmarshall()
 	un >> s1;
 	assert(un.okdone());
 	assert(i1==i && l1==l && s1==s);
+
+	// fixed-width values and vectors of them go out big-endian
+	marshall m2;
+	std::vector<unsigned short> vs;
+	std::vector<int> vi;
+	std::vector<unsigned long long> vl;
+	for (int k = 0; k < 100; k++) {
+		vs.push_back(k * 7);
+		vi.push_back(-k * 1000003);
+		vl.push_back(0x0102030405060708ULL * k);
+	}
+	m2 << (short) -2 << 0x01020304 << 0x0102030405060708ULL << vs << vi << vl;
+	const unsigned char *p = (const unsigned char *) m2.cstr() + RPC_HEADER_SZ;
+	assert(p[0] == 0xff && p[1] == 0xfe);
+	assert(p[2] == 1 && p[3] == 2 && p[4] == 3 && p[5] == 4);
+	for (int k = 0; k < 8; k++)
+		assert(p[6 + k] == k + 1);
+	assert(p[17] == 100 && p[20] == 0 && p[21] == 7);
+	assert(m2.size() == RPC_HEADER_SZ + 14 + 3 * 4 + 100 * (2 + 4 + 8));
+
+	m2.take_buf(&b, &sz);
+	unmarshall un2(b, sz);
+	un2.unpack_req_header(&rh1);
+	short s2;
+	int i2;
+	unsigned long long l2;
+	std::vector<unsigned short> vs2;
+	std::vector<int> vi2;
+	std::vector<unsigned long long> vl2;
+	un2 >> s2 >> i2 >> l2 >> vs2 >> vi2 >> vl2;
+	assert(un2.okdone());
+	assert(s2 == -2 && i2 == 0x01020304 && l2 == 0x0102030405060708ULL);
+	assert(vs2 == vs && vi2 == vi && vl2 == vl);
+
+	// a view keeps the pdu alive after the unmarshall is gone
+	marshall m4;
+	m4 << s << std::string("tail");
+	m4.take_buf(&b, &sz);
+	rpcstr v1, v2;
+	{
+		unmarshall un4(b, sz);
+		un4.unpack_req_header(&rh1);
+		un4 >> v1 >> v2;
+		assert(un4.okdone());
+	}
+	assert(v1 == s && v2.str() == "tail");
+
+	// large strings become segments of the pdu rather than being
+	// copied into it: borrowed, moved, or referred to by a view
+	std::string big(100000, 'b');
+	marshall m5;
+	m5.set_borrow(true);
+	m5 << big << std::string(50000, 'm') << v1 << 7;
+	assert(m5.size() == RPC_HEADER_SZ + 4 * 3 + (int) s.size() + 4);
+	assert(m5.buf()->seg_bytes() == 150000 && m5.buf()->borrows());
+	std::string flat = m5.str();
+	assert(flat.size() == (unsigned) m5.size() + 150000);
+	b = rpcbuf::alloc(flat.size());
+	memcpy(b->data(), flat.data(), flat.size());
+	unmarshall un5(b, flat.size());
+	un5.unpack_req_header(&rh1);
+	std::string big1, mv1, v1s;
+	int seven;
+	un5 >> big1 >> mv1 >> v1s >> seven;
+	assert(un5.okdone());
+	assert(big1 == big && mv1 == std::string(50000, 'm') && v1s == s && seven == 7);
+
+	// containers of non-fixed-width elements, ordered or not
+	std::vector<std::string> vstr;
+	std::map<std::string, std::vector<int> > mp;
+	std::unordered_map<std::string, int> ump;
+	std::set<std::string> st;
+	std::unordered_set<unsigned int> ust;
+	for (int k = 0; k < 50; k++) {
+		std::string key(k, 'k');
+		vstr.push_back(key);
+		mp[key] = std::vector<int>(k, k);
+		ump[key] = k;
+		st.insert(key);
+		ust.insert(k * 31);
+	}
+	marshall m6;
+	m6 << vstr << mp << ump << st << ust;
+	m6.take_buf(&b, &sz);
+	unmarshall un6(b, sz);
+	un6.unpack_req_header(&rh1);
+	std::vector<std::string> vstr1;
+	std::map<std::string, std::vector<int> > mp1;
+	std::unordered_map<std::string, int> ump1;
+	std::set<std::string> st1;
+	std::unordered_set<unsigned int> ust1;
+	un6 >> vstr1 >> mp1 >> ump1 >> st1 >> ust1;
+	assert(un6.okdone());
+	assert(vstr1 == vstr && mp1 == mp && ump1 == ump && st1 == st && ust1 == ust);
+
+	// a vector longer than the rest of the pdu fails cleanly
+	marshall m3;
+	m3 << 1000000 << 1;
+	m3.take_buf(&b, &sz);
+	unmarshall un3(b, sz);
+	un3.unpack_req_header(&rh1);
+	un3 >> vi2;
+	assert(!un3.ok());
+
+	// as do containers of strings and maps
+	marshall m7;
+	m7 << 1000000000 << 1;
+	m7.take_buf(&b, &sz);
+	b->incref();
+	unmarshall un7(b, sz);
+	un7.unpack_req_header(&rh1);
+	un7 >> vstr1;
+	assert(!un7.ok() && vstr1 == vstr);
+	unmarshall un8(b, sz);
+	un8.unpack_req_header(&rh1);
+	un8 >> ump1;
+	assert(!un8.ok() && ump1.empty());
+}
+
+double
+now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// compares (un)marshalling fixed-width values one byte at a time, as
+// marshall used to, with the word-at-a-time and bulk vector paths
+void
+marshall_bench()
+{
+	const int n = 1000000;
+	unsigned long long sum = 0;
+	double t0, t1, t2;
+	req_header h;
+
+	t0 = now_ns();
+	for (int r = 0; r < 10; r++) {
+		marshall m;
+		for (int k = 0; k < n / 10; k++) {
+			unsigned long long x = k;
+			for (int sh = 56; sh >= 0; sh -= 8)
+				m.rawbyte((x >> sh) & 0xff);
+		}
+		sum += m.size();
+	}
+	t1 = now_ns();
+	std::string wire;
+	for (int r = 0; r < 10; r++) {
+		marshall m;
+		for (int k = 0; k < n / 10; k++)
+			m << (unsigned long long) k;
+		sum += m.size();
+		wire = m.str();
+	}
+	t2 = now_ns();
+	printf("marshall unsigned long long: bytewise %.1f ns, word %.1f ns (%.1fx)\n",
+	    (t1 - t0) / n, (t2 - t1) / n, (t1 - t0) / (t2 - t1));
+
+	t0 = now_ns();
+	for (int r = 0; r < 10; r++) {
+		rpcbuf *b = rpcbuf::alloc(wire.size());
+		memcpy(b->data(), wire.data(), wire.size());
+		unmarshall u(b, wire.size());
+		u.unpack_req_header(&h);
+		for (int k = 0; k < n / 10; k++) {
+			unsigned long long x = 0;
+			for (int sh = 56; sh >= 0; sh -= 8)
+				x |= (unsigned long long) (u.rawbyte() & 0xff) << sh;
+			sum += x;
+		}
+	}
+	t1 = now_ns();
+	for (int r = 0; r < 10; r++) {
+		rpcbuf *b = rpcbuf::alloc(wire.size());
+		memcpy(b->data(), wire.data(), wire.size());
+		unmarshall u(b, wire.size());
+		u.unpack_req_header(&h);
+		for (int k = 0; k < n / 10; k++) {
+			unsigned long long x;
+			u >> x;
+			sum += x;
+		}
+	}
+	t2 = now_ns();
+	printf("unmarshall unsigned long long: bytewise %.1f ns, word %.1f ns (%.1fx)\n",
+	    (t1 - t0) / n, (t2 - t1) / n, (t1 - t0) / (t2 - t1));
+
+	std::vector<unsigned int> v(1000);
+	for (unsigned k = 0; k < v.size(); k++)
+		v[k] = k * 2654435761U;
+	int nv = n / v.size();
+	t0 = now_ns();
+	for (int r = 0; r < nv; r++) {
+		marshall m;
+		m << (unsigned int) v.size();
+		for (unsigned k = 0; k < v.size(); k++)
+			for (int sh = 24; sh >= 0; sh -= 8)
+				m.rawbyte((v[k] >> sh) & 0xff);
+		sum += m.size();
+	}
+	t1 = now_ns();
+	for (int r = 0; r < nv; r++) {
+		marshall m;
+		m << v;
+		sum += m.size();
+		wire = m.str();
+	}
+	t2 = now_ns();
+	printf("marshall vector<unsigned int>: bytewise %.1f ns, bulk %.1f ns per element (%.1fx)\n",
+	    (t1 - t0) / n, (t2 - t1) / n, (t1 - t0) / (t2 - t1));
+
+	t0 = now_ns();
+	for (int r = 0; r < nv; r++) {
+		rpcbuf *b = rpcbuf::alloc(wire.size());
+		memcpy(b->data(), wire.data(), wire.size());
+		unmarshall u(b, wire.size());
+		u.unpack_req_header(&h);
+		unsigned int vn = 0;
+		for (int sh = 24; sh >= 0; sh -= 8)
+			vn |= (u.rawbyte() & 0xff) << sh;
+		std::vector<unsigned int> v1;
+		for (unsigned k = 0; k < vn; k++) {
+			unsigned int x = 0;
+			for (int sh = 24; sh >= 0; sh -= 8)
+				x |= (u.rawbyte() & 0xff) << sh;
+			v1.push_back(x);
+		}
+		assert(u.okdone());
+	}
+	t1 = now_ns();
+	for (int r = 0; r < nv; r++) {
+		rpcbuf *b = rpcbuf::alloc(wire.size());
+		memcpy(b->data(), wire.data(), wire.size());
+		unmarshall u(b, wire.size());
+		u.unpack_req_header(&h);
+		std::vector<unsigned int> v1;
+		u >> v1;
+		assert(u.okdone() && v1 == v);
+	}
+	t2 = now_ns();
+	printf("unmarshall vector<unsigned int>: bytewise %.1f ns, bulk %.1f ns per element (%.1fx)\n",
+	    (t1 - t0) / n, (t2 - t1) / n, (t1 - t0) / (t2 - t1));
+	assert(sum > 0);
 }
 
 void *
@@ -290,6 +593,15 @@ simple_tests(rpcc *c)
 	assert(rep == "hello goodbye");
 	printf("   -- string concat RPC .. ok\n");
 
+	// a new client need not bind: the reply to its first call binds it
+	{
+		rpcc fresh(dst);
+		int r;
+		assert(fresh.call(23, 41, r) == 0 && r == 42);
+		assert(fresh.bind() == rpc_const::bind_failure);
+	}
+	printf("   -- first call binds a new client .. ok\n");
+
 	// small request, big reply (perhaps req via UDP, reply via TCP)
 	intret = c->call(25, 70000, rep, rpcc::to(200000));
 	assert(intret == 0);
@@ -312,6 +624,21 @@ simple_tests(rpcc *c)
 	assert(intret < 0);
 	printf("   -- wrong ret value size .. failed ok\n");
 
+	// nine arguments, some moved into the request
+	{
+		std::vector<int> g(3, 1);
+		std::vector<std::string> h;
+		h.push_back("c");
+		h.push_back(std::string(RPC_SEG_MIN, 'd'));
+		std::map<int,int> i;
+		i[7] = 1000;
+		intret = c->call(27, std::string("b"), "a", 1, (char)2, (short)3,
+		    5ULL << 40, g, std::move(h), i, rep, rpcc::to(3000));
+		assert(intret == 1 + 2 + 3 + 5 + 3 + 1000);
+		assert(rep.size() == 3 + RPC_SEG_MIN && rep.compare(0, 3, "abc") == 0);
+		printf("   -- nine arguments .. ok\n");
+	}
+
 	// specify a timeout value to an RPC that should succeed (udp)
 	int xx = 0;
 	intret = c->call(23, 77, xx, rpcc::to(3000));
@@ -333,6 +660,19 @@ simple_tests(rpcc *c)
 	assert(rep.size() == 1000001);
 	printf("   -- huge 1M rpc request .. ok\n");
 
+	// the same request, unmarshalled into views of the pdu
+	int len;
+	intret = c->call(26, big, "z", len);
+	assert(intret == 0 && len == 1000001);
+	printf("   -- huge 1M rpc request as a view .. ok\n");
+
+	// round trips on this host are far below to_min, and so is the
+	// retransmission timeout derived from them
+	for (int i = 0; i < 100; i++)
+		assert(c->call(22, std::string("a"), "b", rep) == 0);
+	assert(c->rto() < rpcc::to_min.to);
+	printf("   -- retransmission timeout follows the round trip .. ok\n");
+
 	// specify a timeout value to an RPC that should timeout (udp)
 	struct sockaddr_in non_existent;
 	memset(&non_existent, 0, sizeof(non_existent));
@@ -344,10 +684,407 @@ simple_tests(rpcc *c)
 	intret = c1->bind(rpcc::to(3000));
 	time_t t1 = time(0);
 	assert(intret < 0 && (t1 - t0) <= 4);
+	assert(c1->rto() == rpcc::to_min.to);
 	printf("   -- rpc timeout .. ok\n");
 	printf("simple_tests OK\n");
 }
 
+void
+bufpool_test(rpcc *c)
+{
+	// once the pool is warm, calls take every request and reply
+	// buffer from it rather than from the heap.  the pool only grows
+	// when some thread misses, so it must settle within a few rounds
+	printf("start bufpool_test ...");
+	std::string rep;
+	rpcbuf::stats_t s0, s1;
+	int round = 0;
+	do {
+		assert(++round <= 20);
+		s0 = rpcbuf::stats();
+		for (int i = 0; i < 1000; i++) {
+			assert(c->call(22, std::string((i % 100) * 100, 'a'), "b", rep) == 0);
+			assert(rep.size() == (unsigned)(i % 100) * 100 + 1);
+		}
+		s1 = rpcbuf::stats();
+		assert(s1.allocs - s0.allocs >= 2000);
+	} while (s1.heap_allocs != s0.heap_allocs);
+	printf(" OK (%llu buffers, none from the heap, after %d rounds)\n",
+	    s1.allocs - s0.allocs, round);
+}
+
+static long long
+mono_ms()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+void
+timer_test()
+{
+	// timers across every level of the wheel run once, never early,
+	// and cancelled ones not at all
+	printf("start timer_test ...");
+	static const int delays[] = { 0, 1, 5, 63, 64, 65, 130, 1000, 4100 };
+	const int nd = sizeof(delays) / sizeof(delays[0]);
+	const int per = 1000;
+
+	pthread_mutex_t mu;
+	pthread_cond_t done_c;
+	assert(pthread_mutex_init(&mu, 0) == 0);
+	assert(pthread_cond_init(&done_c, 0) == 0);
+	std::vector<long long> ran(nd * per, -1);
+	int left = 0;
+
+	long long start = mono_ms();
+	for (int i = 0; i < nd * per; i++) {
+		TimerMgr::timer_id id = TimerMgr::Instance()->schedule(
+			delays[i % nd], [&, i]() {
+				ScopedLock ml(&mu);
+				assert(ran[i] == -1);
+				ran[i] = mono_ms();
+				if (--left == 0)
+					assert(pthread_cond_signal(&done_c) == 0);
+			});
+		if (i % 2 && delays[i % nd] > 0) {
+			assert(TimerMgr::Instance()->cancel(id));
+		} else {
+			ScopedLock ml(&mu);
+			left++;
+		}
+	}
+	{
+		ScopedLock ml(&mu);
+		while (left > 0)
+			assert(pthread_cond_wait(&done_c, &mu) == 0);
+	}
+	for (int i = 0; i < nd * per; i++) {
+		if (i % 2 && delays[i % nd] > 0) {
+			assert(ran[i] == -1);
+		} else {
+			assert(ran[i] >= start + delays[i % nd]);
+		}
+	}
+	assert(pthread_mutex_destroy(&mu) == 0);
+	assert(pthread_cond_destroy(&done_c) == 0);
+	printf(" OK\n");
+}
+
+void
+async_test(int n)
+{
+	// one thread keeps n calls outstanding at once
+	printf("start async_test (%d outstanding calls) ...", n);
+
+	std::vector<int> reps(n);
+	std::vector<std::future<int> > futures;
+	for (int i = 0; i < n; i++) {
+		marshall m;
+		m << i;
+		futures.push_back(clients[0]->async_call_m(i % 2 ? 23 : 24, m, reps[i]));
+	}
+
+	pthread_mutex_t mu;
+	pthread_cond_t done_c;
+	int done = 0;
+	assert(pthread_mutex_init(&mu, 0) == 0);
+	assert(pthread_cond_init(&done_c, 0) == 0);
+	for (int i = 0; i < n; i++) {
+		marshall m;
+		m << i;
+		clients[1]->async_call_m<int>(23, m, [&, i](int ret, int &r) {
+			assert(ret == 0 && r == i + 1);
+			ScopedLock ml(&mu);
+			done++;
+			assert(pthread_cond_signal(&done_c) == 0);
+		});
+	}
+
+	for (int i = 0; i < n; i++) {
+		assert(futures[i].get() == 0);
+		assert(reps[i] == (i % 2 ? i + 1 : i + 2));
+	}
+	{
+		ScopedLock ml(&mu);
+		while (done < n)
+			assert(pthread_cond_wait(&done_c, &mu) == 0);
+	}
+	assert(pthread_mutex_destroy(&mu) == 0);
+	assert(pthread_cond_destroy(&done_c) == 0);
+
+	// an asynchronous call may outlive the strings it was given
+	{
+		std::string *big = new std::string(100000, 'a');
+		marshall m;
+		m.set_borrow(true);
+		m << *big << std::string("b");
+		std::string rep;
+		std::future<int> f = clients[0]->async_call_m(22, m, rep);
+		delete big;
+		assert(f.get() == 0 && rep == std::string(100000, 'a') + "b");
+	}
+
+	// a completion may start the next call on the same client: each
+	// call adds one, a hundred times over
+	{
+		std::promise<int> chained;
+		std::future<int> f = chained.get_future();
+		std::function<void(int, int &)> next = [&](int ret, int &v) {
+			assert(ret == 0);
+			if (v == 100) {
+				chained.set_value(v);
+				return;
+			}
+			marshall m;
+			m << v;
+			clients[0]->async_call_m<int>(23, m, next);
+		};
+		marshall m;
+		m << 0;
+		clients[0]->async_call_m<int>(23, m, next);
+		assert(f.get() == 100);
+	}
+
+	// the same over a lossy connection: a chained call's send fails on
+	// the poll thread that ran the completion, and must not wait on it
+	{
+		assert(setenv("RPC_LOSSY", "5", 1) == 0);
+		rpcc lossy(dst);
+		assert(setenv("RPC_LOSSY", "0", 1) == 0);
+		assert(lossy.bind() == 0);
+		std::promise<int> chained;
+		std::future<int> f = chained.get_future();
+		std::function<void(int, int &)> next = [&](int ret, int &v) {
+			assert(ret == 0);
+			if (v == 200) {
+				chained.set_value(v);
+				return;
+			}
+			marshall m;
+			m << v;
+			lossy.async_call_m<int>(23, m, next);
+		};
+		marshall m;
+		m << 0;
+		lossy.async_call_m<int>(23, m, next);
+		assert(f.get() == 200);
+	}
+
+	// a request the client failed to send before it was bound goes out
+	// again on the next connection, so unbound clients ride out drops
+	assert(setenv("RPC_LOSSY", "30", 1) == 0);
+	for (int i = 0; i < 20; i++) {
+		rpcc c(dst);
+		int r;
+		assert(c.call(23, i, r) == 0 && r == i + 1);
+		rpcc ac(dst);
+		marshall m;
+		m << i;
+		assert(ac.async_call_m(23, m, r).get() == 0 && r == i + 1);
+	}
+	assert(setenv("RPC_LOSSY", "0", 1) == 0);
+
+	// an unbound client's first call binds it, like a synchronous one
+	rpcc unbound(dst);
+	int r;
+	marshall m;
+	m << 7;
+	assert(unbound.async_call_m(23, m, r).get() == 0 && r == 8);
+	assert(unbound.bind() == rpc_const::bind_failure);
+
+	// a call that fails before it is sent still completes on another
+	// thread, so the caller may hold a lock its callback takes
+	{
+		pthread_mutex_t held;
+		assert(pthread_mutex_init(&held, 0) == 0);
+		std::promise<int> failed;
+		std::future<int> f = failed.get_future();
+		marshall m;
+		m << 0;
+		assert(pthread_mutex_lock(&held) == 0);
+		unbound.async_call_m<int>(rpc_const::bind, m, [&](int ret, int &) {
+			{
+				ScopedLock hl(&held);
+			}
+			failed.set_value(ret);
+		});
+		assert(pthread_mutex_unlock(&held) == 0);
+		assert(f.get() == rpc_const::bind_failure);
+		assert(pthread_mutex_destroy(&held) == 0);
+	}
+	printf(" OK\n");
+}
+
+// raises the soft fd limit as far as the hard limit allows and
+// returns the new limit.
+int
+raise_fd_limit()
+{
+	struct rlimit rl;
+	assert(getrlimit(RLIMIT_NOFILE, &rl) == 0);
+	if (rl.rlim_cur < rl.rlim_max) {
+		rl.rlim_cur = rl.rlim_max;
+		assert(setrlimit(RLIMIT_NOFILE, &rl) == 0);
+	}
+	return rl.rlim_cur > 1000000 ? 1000000 : (int) rl.rlim_cur;
+}
+
+void
+many_conn_client(int n)
+{
+	// every client gets its own connection.  they do not retransmit,
+	// so the server skips at-most-once state and random nonces
+	// cannot collide.
+	std::vector<rpcc *> cls(n);
+	for (int i = 0; i < n; i++) {
+		cls[i] = new rpcc(dst, false);
+		assert(cls[i]->bind() == 0);
+	}
+
+	// all n connections are open; call on all of them at once
+	std::vector<int> reps(n);
+	std::vector<std::future<int> > futures;
+	for (int i = 0; i < n; i++) {
+		marshall m;
+		m << i;
+		futures.push_back(cls[i]->async_call_m(23, m, reps[i]));
+	}
+	for (int i = 0; i < n; i++) {
+		assert(futures[i].get() == 0);
+		assert(reps[i] == i + 1);
+	}
+
+	for (int i = 0; i < n; i++)
+		delete cls[i];
+}
+
+void
+reply_budget_test()
+{
+	printf("start reply_budget_test ...");
+	rpcc *c = clients[1];
+	rpcs::reply_stats_t s0 = server->reply_stats();
+
+	// the first round limits each client's cached replies, the second
+	// those of all clients
+	for (int round = 0; round < 2; round++) {
+		if (round == 0)
+			server->set_reply_budget(1 << 20, 64 << 20);
+		else
+			server->set_reply_budget(64 << 20, 1 << 20);
+
+		// a call held up in the server keeps the client from
+		// acknowledging the replies after it, so the server has to
+		// cache them until it is done
+		marshall m;
+		m << 500;
+		int r;
+		std::future<int> f = c->async_call_m(28, m, r);
+		for (int i = 0; i < 40; i++) {
+			std::string rep;
+			assert(c->call(25, 100000, rep) == 0 && rep.size() == 100000);
+		}
+		rpcs::reply_stats_t s = server->reply_stats();
+		assert(s.bytes <= (1 << 20));
+		assert(s.evicted >= s0.evicted + 20);
+		assert(f.get() == 0 && r == 500);
+		s0 = s;
+	}
+
+	// a reply referring to bytes of its request is charged for the
+	// whole buffer holding them, not just for the bytes.  that buffer
+	// is the request's own rather than the connection's receive buffer
+	rpcc *ec = new rpcc(dst);
+	assert(ec->bind() == 0);
+	s0 = server->reply_stats();
+	std::string big(RPC_SEG_MIN + 1000, 'e');
+	std::string rep;
+	assert(ec->call(29, big, rep) == 0 && rep == big);
+	rpcs::reply_stats_t s1 = server->reply_stats();
+	assert(s1.bytes >= s0.bytes + 2 * RPC_SEG_MIN - 256);
+	assert(s1.bytes < s0.bytes + (64 << 10)); // a receive buffer
+	delete ec;
+
+	server->set_reply_budget(16 << 20, 256 << 20);
+	printf(" OK\n");
+}
+
+void
+session_test()
+{
+	printf("start session_test ...");
+	rpcs::session_stats_t s0 = server->session_stats();
+
+	rpcc *c = new rpcc(dst);
+	assert(c->bind() == 0);
+	int r;
+	assert(c->call(23, 1, r) == 0 && r == 2);
+	rpcs::session_stats_t s1 = server->session_stats();
+	assert(s1.sessions > s0.sessions);
+	delete c;
+
+	// every client is idle now, so all sessions expire and the server
+	// lets go of their connections
+	server->set_session_ttl(200);
+	usleep(1000 * 1000);
+	rpcs::session_stats_t s2 = server->session_stats();
+	assert(s2.sessions == 0 && s2.conns == 0);
+	assert(s2.reaped >= s1.reaped + s1.sessions);
+	assert(s2.conns_released >= s1.conns_released + s1.conns);
+
+	// a session whose request is still being handled doesn't expire,
+	// however long the handler takes
+	c = new rpcc(dst);
+	assert(c->bind() == 0);
+	marshall m;
+	m << 1000;
+	std::future<int> f = c->async_call_m(28, m, r);
+	usleep(700 * 1000);
+	assert(server->session_stats().sessions == 1);
+	assert(f.get() == 0 && r == 1000);
+	delete c;
+	usleep(1000 * 1000);
+	assert(server->session_stats().sessions == 0);
+
+	// clients whose sessions expired start new ones
+	server->set_session_ttl(10 * 60 * 1000);
+	assert(clients[0]->call(23, 2, r) == 0 && r == 3);
+	assert(server->session_stats().sessions == 1);
+	printf(" OK\n");
+}
+
+void
+many_conn_test(int n)
+{
+	// the server holds n connections at once.  the clients run in
+	// a child process so that each end of the connections counts
+	// against its own process's fd limit.
+	int limit = raise_fd_limit();
+	if (n > limit - 100) {
+		n = limit - 100;
+	}
+	printf("start many_conn_test (%d connections) ...", n);
+
+	char portarg[16], narg[16];
+	snprintf(portarg, sizeof(portarg), "%d", port);
+	snprintf(narg, sizeof(narg), "%d", n);
+
+	pid_t pid = fork();
+	assert(pid >= 0);
+	if (pid == 0) {
+		execl(progname, progname, "-c", "-p", portarg, "-n", narg, (char *) NULL);
+		perror("many_conn_test exec");
+		_exit(1);
+	}
+
+	int status;
+	assert(waitpid(pid, &status, 0) == pid);
+	assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+	printf(" OK\n");
+}
+
 void 
 concurrent_test(int nt)
 {
@@ -418,7 +1155,13 @@ lossy_test()
 	for(int i = 0; i < nt; i++){
 		assert(pthread_join(th[i], NULL) == 0);
 	}
-	printf(" OK\n");
+	// the dropped connections were noticed as they died, not at the
+	// callers' timeouts
+	unsigned int failovers = 0;
+	for (int i = 0; i < NUM_CL; i++)
+		failovers += clients[i]->failovers();
+	assert(failovers > 0);
+	printf(" OK (%u failovers)\n", failovers);
 	assert(setenv("RPC_LOSSY", "0", 1) == 0);
 }
 
@@ -432,14 +1175,46 @@ failure_test()
 
 	delete server;
 
+	// the refused connect fails the bind at once, not at its timeout
 	client1 = new rpcc(dst);
-	assert (client1->bind(rpcc::to(3000)) < 0);
+	long long start = mono_ms();
+	assert (client1->bind(rpcc::to(3000)) == rpc_const::conn_failure);
+	assert (mono_ms() - start < 1000);
 	printf("   -- create new client and try to bind to failed server .. failed ok\n");
 
-	delete client1;
+	// a few more failures open the circuit breaker, which then fails
+	// calls without trying
+	int ret;
+	for (int i = 0; i < 10; i++) {
+		ret = client1->bind(rpcc::to(3000));
+		if (ret == rpc_const::unavailable_failure)
+			break;
+		assert(ret == rpc_const::conn_failure);
+	}
+	assert(ret == rpc_const::unavailable_failure);
+	assert(client1->trips() == 1);
+	start = mono_ms();
+	for (int i = 0; i < 100; i++)
+		assert(client1->bind(rpcc::to(3000)) == rpc_const::unavailable_failure);
+	assert(mono_ms() - start < 100);
+	printf("   -- circuit breaker opens on a failed server .. ok\n");
 
 	startserver();
 
+	// a probe finds the server back and closes the breaker
+	for (int i = 0; i < 50; i++) {
+		ret = client1->bind(rpcc::to(3000));
+		if (ret != rpc_const::unavailable_failure &&
+		    ret != rpc_const::conn_failure)
+			break;
+		usleep(100 * 1000);
+	}
+	assert(ret == 0);
+	assert(client1->trips() == 1);
+	printf("   -- circuit breaker closes on the recovered server .. ok\n");
+
+	delete client1;
+
 	std::string rep;
 	int intret = client->call(22, "hello", " goodbye", rep);
 	assert(intret == rpc_const::oldsrv_failure);
@@ -459,7 +1234,6 @@ failure_test()
 
 
 	int nt = 10;
-	int ret;
 	printf("   -- concurrent test on new rpc client w/ %d threads ..", nt);
 
 	pthread_t th[nt];
@@ -504,13 +1278,23 @@ main(int argc, char *argv[])
 
 	bool isclient = false;
 	bool isserver = false;
+	int nconns = 0;
+
+	progname = argv[0];
 
 	srandom(getpid());
 	port = 20000 + (getpid() % 10000);
 
+	// spread connections over several PollMgr threads even on a
+	// single cpu, unless told otherwise
+	assert(setenv("RPC_REACTORS", "4", 0) == 0);
+
 	char ch = 0;
-	while ((ch = getopt(argc, argv, "csd:p:l"))!=-1) {
+	while ((ch = getopt(argc, argv, "bcsd:p:n:l"))!=-1) {
 		switch (ch) {
+			case 'b':
+				marshall_bench();
+				exit(0);
 			case 'c':
 				isclient = true;
 				break;
@@ -523,6 +1307,9 @@ main(int argc, char *argv[])
 			case 'p':
 				port = atoi(optarg);
 				break;
+			case 'n':
+				nconns = atoi(optarg);
+				break;
 			case 'l':
 				assert(setenv("RPC_LOSSY", "5", 1) == 0);
 			default:
@@ -568,8 +1355,23 @@ main(int argc, char *argv[])
 			assert (clients[i]->bind() == 0);
 		}
 
+		if (nconns > 0) {
+			// many_conn_test's child: only hold the connections
+			raise_fd_limit();
+			many_conn_client(nconns);
+			exit(0);
+		}
+
 		simple_tests(clients[0]);
+		bufpool_test(clients[0]);
+		timer_test();
+		async_test(5000);
 		concurrent_test(10);
+		if (isserver) {
+			reply_budget_test();
+			session_test();
+			many_conn_test(10000);
+		}
 		lossy_test();
 		if (isserver) {
 			failure_test();
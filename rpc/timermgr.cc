@@ -0,0 +1,279 @@
+#include <errno.h>
+
+#include "slock.h"
+#include "method_thread.h"
+#include "rpc.h"
+
+#include "timermgr.h"
+
+#define NEVER (~0ULL)
+
+TimerMgr *TimerMgr::instance = NULL;
+static pthread_once_t timermgr_is_initialized = PTHREAD_ONCE_INIT;
+
+void
+TimerMgrInit()
+{
+	TimerMgr::instance = new TimerMgr();
+}
+
+TimerMgr *
+TimerMgr::Instance()
+{
+	pthread_once(&timermgr_is_initialized, TimerMgrInit);
+	return instance;
+}
+
+TimerMgr::TimerMgr() : running_(0), wake_(NEVER), count_(0), due_(NULL),
+	free_(NULL)
+{
+	for (int l = 0; l < TW_LEVELS; l++)
+		for (int i = 0; i < TW_SLOTS; i++)
+			wheel_[l][i] = NULL;
+	tick_ = now_tick();
+
+	pthread_condattr_t ca;
+	assert(pthread_condattr_init(&ca) == 0);
+	assert(pthread_condattr_setclock(&ca, CLOCK_MONOTONIC) == 0);
+	assert(pthread_mutex_init(&m_, NULL) == 0);
+	assert(pthread_cond_init(&changed_c_, &ca) == 0);
+	assert(pthread_cond_init(&done_c_, NULL) == 0);
+	assert(pthread_condattr_destroy(&ca) == 0);
+	assert((th_ = method_thread(this, false, &TimerMgr::timer_loop)) != 0);
+}
+
+TimerMgr::~TimerMgr()
+{
+	//never kill me!!!
+	assert(0);
+}
+
+//milliseconds of CLOCK_MONOTONIC
+unsigned long long
+TimerMgr::now_tick()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000ULL + now.tv_nsec / 1000000;
+}
+
+//assumes thread holds m_
+TimerMgr::timer *
+TimerMgr::get_timer()
+{
+	timer *t = free_;
+	if (t) {
+		free_ = t->next;
+		//a new generation, so the old id no longer matches
+		t->id += 1ULL << 32;
+	} else {
+		t = new timer();
+		t->id = (1ULL << 32) | nodes_.size();
+		nodes_.push_back(t);
+	}
+	t->head = NULL;
+	t->prev = t->next = NULL;
+	return t;
+}
+
+//assumes thread holds m_
+void
+TimerMgr::put_timer(timer *t)
+{
+	t->cb = nullptr;
+	t->next = free_;
+	free_ = t;
+}
+
+//assumes thread holds m_
+void
+TimerMgr::link(timer **head, timer *t)
+{
+	t->head = head;
+	t->prev = NULL;
+	t->next = *head;
+	if (*head)
+		(*head)->prev = t;
+	*head = t;
+}
+
+//assumes thread holds m_
+void
+TimerMgr::unlink(timer *t)
+{
+	if (t->prev)
+		t->prev->next = t->next;
+	else
+		*t->head = t->next;
+	if (t->next)
+		t->next->prev = t->prev;
+	t->head = NULL;
+}
+
+//files t under the level and slot its distance from tick_ calls for.  a
+//timer beyond the top level's reach waits in its farthest slot and is
+//filed again when that slot cascades.
+//assumes thread holds m_
+void
+TimerMgr::add(timer *t)
+{
+	unsigned long long e = t->expires > tick_ ? t->expires : tick_;
+	unsigned long long d = e - tick_;
+	int l = 0;
+	while (l < TW_LEVELS - 1 && d >= 1ULL << ((l + 1) * TW_BITS))
+		l++;
+	if (d >= 1ULL << (TW_LEVELS * TW_BITS))
+		e = tick_ + (1ULL << (TW_LEVELS * TW_BITS)) - 1;
+	link(&wheel_[l][(e >> (l * TW_BITS)) & (TW_SLOTS - 1)], t);
+}
+
+//moves the timers of a slot down the wheel, now that tick_ has reached it.
+//assumes thread holds m_
+void
+TimerMgr::cascade(int level, unsigned long long slot)
+{
+	timer *t = wheel_[level][slot];
+	wheel_[level][slot] = NULL;
+	while (t) {
+		timer *next = t->next;
+		add(t);
+		t = next;
+	}
+}
+
+//the first tick at or after tick_ that may have work: a level 0 slot to
+//run or a slot above to cascade.  looks at every slot at most once.
+//assumes thread holds m_
+unsigned long long
+TimerMgr::next_tick()
+{
+	for (int l = 0; l < TW_LEVELS; l++) {
+		int shift = l * TW_BITS;
+		unsigned long long cur = tick_ >> shift;
+		unsigned long long end = cur | (TW_SLOTS - 1);
+		//a slot above level 0 cascades when tick_ reaches its start
+		unsigned long long s = cur;
+		if (l > 0 && (tick_ & ((1ULL << shift) - 1)))
+			s++;
+		for (int k = 0; k < TW_SLOTS; k++, s++) {
+			if (!wheel_[l][s & (TW_SLOTS - 1)])
+				continue;
+			//a slot of the next lap waits for the cascade from above
+			//at the end of this one
+			return (s <= end ? s : end + 1) << shift;
+		}
+	}
+	return ((tick_ >> (TW_LEVELS * TW_BITS)) + 1) << (TW_LEVELS * TW_BITS);
+}
+
+//runs the timers due at tick_.
+//assumes thread holds m_, which it releases while a callback runs
+void
+TimerMgr::run_tick()
+{
+	if (!(tick_ & (TW_SLOTS - 1))) {
+		for (int l = 1; l < TW_LEVELS; l++) {
+			unsigned long long slot = (tick_ >> (l * TW_BITS)) & (TW_SLOTS - 1);
+			cascade(l, slot);
+			if (slot)
+				break;
+		}
+	}
+
+	timer **slot = &wheel_[0][tick_ & (TW_SLOTS - 1)];
+	while (*slot) {
+		timer *t = *slot;
+		unlink(t);
+		link(&due_, t);
+	}
+	tick_++;
+
+	//callbacks may cancel the timers after them on due_
+	while (due_) {
+		timer *t = due_;
+		unlink(t);
+		std::function<void()> cb;
+		std::swap(cb, t->cb);
+		running_ = t->id;
+		put_timer(t);
+		count_--;
+
+		assert(pthread_mutex_unlock(&m_) == 0);
+		cb();
+		assert(pthread_mutex_lock(&m_) == 0);
+
+		running_ = 0;
+		assert(pthread_cond_broadcast(&done_c_) == 0);
+	}
+}
+
+TimerMgr::timer_id
+TimerMgr::schedule(int ms, std::function<void()> cb)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	//round up, so that cb never runs early
+	unsigned long long start = now.tv_sec * 1000ULL +
+		(now.tv_nsec + 999999) / 1000000;
+
+	ScopedLock ml(&m_);
+	if (!count_ && tick_ < start) {
+		//the wheel is empty: skip the idle ticks
+		tick_ = start;
+	}
+	timer *t = get_timer();
+	t->expires = start + (ms > 0 ? ms : 0);
+	t->cb = std::move(cb);
+	add(t);
+	count_++;
+	if (t->expires < wake_)
+		assert(pthread_cond_signal(&changed_c_) == 0);
+	return t->id;
+}
+
+bool
+TimerMgr::cancel(timer_id id, bool wait)
+{
+	ScopedLock ml(&m_);
+	unsigned long long i = id & 0xffffffffULL;
+	if (i < nodes_.size() && nodes_[i]->id == id && nodes_[i]->head) {
+		timer *t = nodes_[i];
+		unlink(t);
+		put_timer(t);
+		count_--;
+		return true;
+	}
+	if (wait && !pthread_equal(pthread_self(), th_)) {
+		while (running_ == id)
+			assert(pthread_cond_wait(&done_c_, &m_) == 0);
+	}
+	return false;
+}
+
+void
+TimerMgr::timer_loop()
+{
+	ScopedLock ml(&m_);
+	while (1) {
+		if (!count_) {
+			wake_ = NEVER;
+			assert(pthread_cond_wait(&changed_c_, &m_) == 0);
+			continue;
+		}
+
+		unsigned long long next = next_tick();
+		if (next > now_tick()) {
+			wake_ = next;
+			struct timespec deadline;
+			deadline.tv_sec = next / 1000;
+			deadline.tv_nsec = (next % 1000) * 1000000;
+			pthread_cond_timedwait(&changed_c_, &m_, &deadline);
+			continue;
+		}
+
+		//nothing is due before next
+		wake_ = 0;
+		tick_ = next;
+		run_tick();
+	}
+}
@@ -0,0 +1,76 @@
+#ifndef timermgr_h
+#define timermgr_h
+
+#include <pthread.h>
+#include <time.h>
+#include <functional>
+#include <vector>
+
+// TimerMgr runs callbacks on a single timer thread once their delay has
+// passed.  There is one instance per process; callbacks
+// must not block for long since they delay every other timer.
+//
+// timers sit in a hierarchical wheel ticking once a millisecond of
+// CLOCK_MONOTONIC, so they are immune to changes of the wall clock.  a
+// slot of level l spans TW_SLOTS^l ticks; as the wheel reaches a slot
+// above level 0, its timers move down to the slots of the level below.
+// scheduling and cancelling are O(1) however many timers are pending.
+class TimerMgr {
+	public:
+		typedef unsigned long long timer_id;
+
+		TimerMgr();
+		~TimerMgr();
+
+		static TimerMgr *Instance();
+		static TimerMgr *instance;
+
+		// run cb once, ms milliseconds from now
+		timer_id schedule(int ms, std::function<void()> cb);
+
+		// returns true if the timer was removed before it ran.  if wait
+		// is set and the callback is running on another thread, waits
+		// for it to finish so that the caller may free what it uses
+		bool cancel(timer_id id, bool wait = true);
+
+		void timer_loop();
+
+	private:
+		enum { TW_BITS = 6, TW_SLOTS = 1 << TW_BITS, TW_LEVELS = 4 };
+
+		// timers are never freed, only recycled.  a timer_id is the
+		// timer's index in nodes_ and, above bit 32, its generation
+		struct timer {
+			timer_id id;
+			unsigned long long expires; // tick it is due
+			std::function<void()> cb;
+			timer **head;               // list it is on; NULL if idle
+			timer *prev, *next;
+		};
+
+		unsigned long long now_tick();
+		timer *get_timer();
+		void put_timer(timer *t);
+		void link(timer **head, timer *t);
+		void unlink(timer *t);
+		void add(timer *t);
+		void cascade(int level, unsigned long long slot);
+		unsigned long long next_tick();
+		void run_tick();
+
+		pthread_mutex_t m_;
+		pthread_cond_t changed_c_;   // earlier timer added
+		pthread_cond_t done_c_;      // running_ callback returned
+		pthread_t th_;
+
+		timer_id running_;
+		unsigned long long tick_;    // the next tick to run
+		unsigned long long wake_;    // tick the timer thread sleeps until
+		int count_;                  // pending timers
+		timer *wheel_[TW_LEVELS][TW_SLOTS];
+		timer *due_;                 // timers of the tick being run
+		timer *free_;
+		std::vector<timer *> nodes_;
+};
+
+#endif /* timermgr_h */